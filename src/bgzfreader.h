@@ -0,0 +1,383 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	input of the tools: plain text, gzip or BGZF (the block-gzip of htslib,
+ *	a series of gzip members of at most 64kb, each one holding its size).
+ *	The blocks of a BGZF file are independent, they are inflated by a pool
+ *	of threads while the next ones are read ahead. Other gzip files are
+ *	inflated with zlib by the calling thread.
+ *	A plain or a BGZF file can be moved to an offset returned by tell():
+ *	the offset in the file, or the BGZF virtual offset (offset of the
+ *	compressed block<<16 | offset in the inflated block).
+ */
+#ifndef BGZF_READER_H
+#define BGZF_READER_H
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdexcept>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_MAX_BLOCK_SIZE 65536
+
+class BgzfReader
+    {
+    private:
+	/* a BGZF block, read then inflated by a worker */
+	struct Block
+	    {
+	    enum { free_block, todo, done, failed } state;
+	    /* offset of the block in the file */
+	    uint64_t coffset;
+	    std::vector<unsigned char> compressed;
+	    std::vector<char> data;
+	    };
+	enum { plain, gzip, bgzf } mode;
+	FILE* in;
+	/* bytes read from 'in' and not consumed yet: input[input_start,input_end[ */
+	std::vector<unsigned char> input;
+	size_t input_start;
+	size_t input_end;
+	bool input_eof;
+	/* offset in the file of input[input_start] */
+	uint64_t position;
+	/* gzip */
+	z_stream strm;
+	bool strm_end;
+	/* bgzf: a ring of blocks, 'head' is the block being consumed */
+	std::vector<Block> blocks;
+	size_t head;
+	size_t offset;
+	std::deque<Block*> queue;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_todo;
+	pthread_cond_t cond_done;
+	bool finished;
+	/* copies are not allowed */
+	BgzfReader(const BgzfReader&);
+	BgzfReader& operator=(const BgzfReader&);
+
+	/** reads from 'in' until 'n' bytes are available or the end of the file, returns the number available */
+	size_t fill(size_t n)
+	    {
+	    if(input_end-input_start>=n || input_eof) return input_end-input_start;
+	    std::memmove(&input[0],&input[input_start],input_end-input_start);
+	    input_end-=input_start;
+	    input_start=0;
+	    if(input.size()< n) input.resize(n);
+	    while(input_end< n)
+		{
+		size_t count=std::fread(&input[input_end],1,input.size()-input_end,in);
+		if(count==0)
+		    {
+		    if(std::ferror(in)) throw std::runtime_error("Cannot read input");
+		    input_eof=true;
+		    break;
+		    }
+		input_end+=count;
+		}
+	    return input_end-input_start;
+	    }
+
+	static bool isBgzf(const unsigned char* h,size_t n)
+	    {
+	    return n>=BGZF_HEADER_SIZE &&
+		h[0]==31 && h[1]==139 && h[2]==8 && (h[3]&4)!=0 &&
+		h[10]==6 && h[11]==0 && h[12]=='B' && h[13]=='C' && h[14]==2 && h[15]==0;
+	    }
+
+	/** moves the next BGZF block of the input to 'b', false at the end of the file */
+	bool readBlock(Block* b)
+	    {
+	    size_t n=fill(BGZF_HEADER_SIZE);
+	    if(n==0) return false;
+	    const unsigned char* h=&input[input_start];
+	    if(!isBgzf(h,n)) throw std::runtime_error("Bad BGZF block header");
+	    size_t size=(h[16]|(h[17]<<8))+1;
+	    if(size< BGZF_HEADER_SIZE+8 || fill(size)< size) throw std::runtime_error("Truncated BGZF block");
+	    b->compressed.assign(input.begin()+input_start,input.begin()+input_start+size);
+	    b->coffset=position;
+	    input_start+=size;
+	    position+=size;
+	    b->state=Block::todo;
+	    return true;
+	    }
+
+	static bool inflateBlock(Block* b)
+	    {
+	    const unsigned char* p=&b->compressed[0];
+	    size_t size=b->compressed.size();
+	    uLong crc=p[size-8]|(p[size-7]<<8)|(p[size-6]<<16)|((uLong)p[size-5]<<24);
+	    size_t isize=p[size-4]|(p[size-3]<<8)|(p[size-2]<<16)|((size_t)p[size-1]<<24);
+	    if(isize>BGZF_MAX_BLOCK_SIZE) return false;
+	    b->data.resize(isize);
+	    if(isize==0) return true;
+	    z_stream s;
+	    std::memset(&s,0,sizeof(z_stream));
+	    if(inflateInit2(&s,-15)!=Z_OK) return false;
+	    s.next_in=(Bytef*)&p[BGZF_HEADER_SIZE];
+	    s.avail_in=size-BGZF_HEADER_SIZE-8;
+	    s.next_out=(Bytef*)&b->data[0];
+	    s.avail_out=isize;
+	    int ret=inflate(&s,Z_FINISH);
+	    inflateEnd(&s);
+	    if(ret!=Z_STREAM_END || s.total_out!=isize) return false;
+	    return crc32(crc32(0L,Z_NULL,0),(const Bytef*)&b->data[0],isize)==crc;
+	    }
+
+	static void* work(void* arg)
+	    {
+	    BgzfReader* r=(BgzfReader*)arg;
+	    for(;;)
+		{
+		::pthread_mutex_lock(&r->mutex);
+		while(!r->finished && r->queue.empty())
+		    {
+		    ::pthread_cond_wait(&r->cond_todo,&r->mutex);
+		    }
+		if(r->queue.empty())
+		    {
+		    ::pthread_mutex_unlock(&r->mutex);
+		    break;
+		    }
+		Block* b=r->queue.front();
+		r->queue.pop_front();
+		::pthread_mutex_unlock(&r->mutex);
+
+		bool ok=inflateBlock(b);
+
+		::pthread_mutex_lock(&r->mutex);
+		b->state=(ok?Block::done:Block::failed);
+		::pthread_cond_broadcast(&r->cond_done);
+		::pthread_mutex_unlock(&r->mutex);
+		}
+	    return NULL;
+	    }
+
+	/** reads the next block into 'b' and hands it to the workers (or inflates it without thread) */
+	void submit(Block* b)
+	    {
+	    if(!readBlock(b))
+		{
+		b->state=Block::free_block;
+		return;
+		}
+	    if(threads.empty())
+		{
+		b->state=(inflateBlock(b)?Block::done:Block::failed);
+		return;
+		}
+	    ::pthread_mutex_lock(&mutex);
+	    queue.push_back(b);
+	    ::pthread_cond_signal(&cond_todo);
+	    ::pthread_mutex_unlock(&mutex);
+	    }
+
+	/**
+	 * the block holding the next byte, after the consumed and the empty
+	 * blocks (the EOF block of each member of a concatenated file). NULL
+	 * at the end of the input.
+	 */
+	Block* current()
+	    {
+	    for(;;)
+		{
+		Block* b=&blocks[head];
+		if(!threads.empty())
+		    {
+		    ::pthread_mutex_lock(&mutex);
+		    while(b->state==Block::todo) ::pthread_cond_wait(&cond_done,&mutex);
+		    ::pthread_mutex_unlock(&mutex);
+		    }
+		if(b->state==Block::free_block) return NULL;
+		if(b->state==Block::failed) throw std::runtime_error("Cannot inflate BGZF block");
+		if(offset< b->data.size()) return b;
+		/* consumed: the slot receives the block after the last one of the ring */
+		submit(b);
+		head=(head+1)%blocks.size();
+		offset=0;
+		}
+	    }
+
+	int readBgzf(char* buf,size_t n)
+	    {
+	    Block* b=current();
+	    if(b==NULL) return 0;
+	    size_t count=std::min(n,b->data.size()-offset);
+	    std::memcpy(buf,&b->data[offset],count);
+	    offset+=count;
+	    return (int)count;
+	    }
+
+	int readGzip(char* buf,size_t n)
+	    {
+	    strm.next_out=(Bytef*)buf;
+	    strm.avail_out=n;
+	    while(strm.avail_out==n)
+		{
+		if(strm_end)
+		    {
+		    /* concatenated gzip members */
+		    if(fill(1)==0) break;
+		    if(inflateReset(&strm)!=Z_OK) throw std::runtime_error("Cannot inflate input");
+		    strm_end=false;
+		    }
+		if(input_start==input_end && fill(1)==0) throw std::runtime_error("Truncated gzip input");
+		strm.next_in=(Bytef*)&input[input_start];
+		strm.avail_in=input_end-input_start;
+		int ret=inflate(&strm,Z_NO_FLUSH);
+		input_start=input_end-strm.avail_in;
+		if(ret==Z_STREAM_END) strm_end=true;
+		else if(ret!=Z_OK && ret!=Z_BUF_ERROR) throw std::runtime_error("Cannot inflate input");
+		}
+	    return (int)(n-strm.avail_out);
+	    }
+
+	int readPlain(char* buf,size_t n)
+	    {
+	    if(input_start< input_end)
+		{
+		size_t count=std::min(n,input_end-input_start);
+		std::memcpy(buf,&input[input_start],count);
+		input_start+=count;
+		position+=count;
+		return (int)count;
+		}
+	    size_t count=std::fread(buf,1,n,in);
+	    if(count==0 && std::ferror(in)) throw std::runtime_error("Cannot read input");
+	    position+=count;
+	    return (int)count;
+	    }
+    public:
+	/** 'nthreads' inflate the BGZF blocks, none if <=1 */
+	BgzfReader(FILE* in,int nthreads=1):
+	    in(in),input(2*BGZF_MAX_BLOCK_SIZE),input_start(0),input_end(0),input_eof(false),position(0),
+	    strm_end(false),head(0),offset(0),finished(false)
+	    {
+	    size_t n=fill(BGZF_HEADER_SIZE);
+	    const unsigned char* h=&input[0];
+	    if(isBgzf(h,n))
+		{
+		mode=bgzf;
+		::pthread_mutex_init(&mutex,NULL);
+		::pthread_cond_init(&cond_todo,NULL);
+		::pthread_cond_init(&cond_done,NULL);
+		/* read ahead: the ring holds more blocks than there are workers */
+		blocks.resize(nthreads>1?nthreads*4:1);
+		if(nthreads>1)
+		    {
+		    threads.resize(nthreads);
+		    for(size_t i=0;i< threads.size();++i)
+			{
+			if(::pthread_create(&threads[i],NULL,BgzfReader::work,this)!=0)
+			    {
+			    throw std::runtime_error("Cannot create thread");
+			    }
+			}
+		    }
+		for(size_t i=0;i< blocks.size();++i) submit(&blocks[i]);
+		}
+	    else if(n>=2 && h[0]==31 && h[1]==139)
+		{
+		mode=gzip;
+		std::memset(&strm,0,sizeof(z_stream));
+		if(inflateInit2(&strm,15+16)!=Z_OK) throw std::runtime_error("Cannot init zlib");
+		}
+	    else
+		{
+		mode=plain;
+		}
+	    }
+
+	~BgzfReader()
+	    {
+	    if(mode==gzip) inflateEnd(&strm);
+	    if(mode!=bgzf) return;
+	    ::pthread_mutex_lock(&mutex);
+	    finished=true;
+	    queue.clear();
+	    ::pthread_cond_broadcast(&cond_todo);
+	    ::pthread_mutex_unlock(&mutex);
+	    for(size_t i=0;i< threads.size();++i) ::pthread_join(threads[i],NULL);
+	    ::pthread_cond_destroy(&cond_done);
+	    ::pthread_cond_destroy(&cond_todo);
+	    ::pthread_mutex_destroy(&mutex);
+	    }
+
+	bool compressed() const
+	    {
+	    return mode!=plain;
+	    }
+
+	/** offset of the next byte returned by read() */
+	uint64_t tell()
+	    {
+	    switch(mode)
+		{
+		case bgzf:
+		    {
+		    /* the next byte is in the block read() will return it from */
+		    const Block* b=current();
+		    if(b==NULL) return position<<16;
+		    return (b->coffset<<16)|offset;
+		    }
+		case gzip: throw std::runtime_error("Cannot get the offset of a gzip input, use BGZF");
+		default: return position;
+		}
+	    }
+
+	/** moves to an offset returned by tell(), the input must be a file */
+	void seek(uint64_t voffset)
+	    {
+	    if(mode==gzip) throw std::runtime_error("Cannot seek in a gzip input, use BGZF");
+	    if(mode==bgzf && !threads.empty())
+		{
+		/* the blocks waiting for a thread are dropped, the others are finished */
+		::pthread_mutex_lock(&mutex);
+		while(!queue.empty())
+		    {
+		    queue.front()->state=Block::free_block;
+		    queue.pop_front();
+		    }
+		for(size_t i=0;i< blocks.size();++i)
+		    {
+		    while(blocks[i].state==Block::todo) ::pthread_cond_wait(&cond_done,&mutex);
+		    }
+		::pthread_mutex_unlock(&mutex);
+		}
+	    position=(mode==bgzf?voffset>>16:voffset);
+	    if(::fseeko(in,(off_t)position,SEEK_SET)!=0) throw std::runtime_error("Cannot seek in input");
+	    input_start=0;
+	    input_end=0;
+	    input_eof=false;
+	    if(mode!=bgzf) return;
+	    head=0;
+	    for(size_t i=0;i< blocks.size();++i) submit(&blocks[i]);
+	    offset=(size_t)(voffset&0xFFFF);
+	    }
+
+	/** like gzread: reads at most 'n' bytes, returns 0 at the end of the input */
+	int read(char* buf,size_t n)
+	    {
+	    switch(mode)
+		{
+		case bgzf: return readBgzf(buf,n);
+		case gzip: return readGzip(buf,n);
+		default: return readPlain(buf,n);
+		}
+	    }
+    };
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	output buffer: the fields are appended to a large block written with
+ *	one fwrite when full, instead of one stream operation (and one flush
+ *	with endl) per field.
+ */
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+class BufferedWriter
+    {
+    private:
+	FILE* out;
+	char* buffer;
+	size_t capacity;
+	size_t length;
+	/* copies are not allowed */
+	BufferedWriter(const BufferedWriter&);
+	BufferedWriter& operator=(const BufferedWriter&);
+    public:
+	BufferedWriter(FILE* out,size_t capacity=1048576):
+	    out(out),buffer(new char[capacity]),capacity(capacity),length(0)
+	    {
+	    }
+	~BufferedWriter()
+	    {
+	    flush();
+	    delete[] buffer;
+	    }
+	void flush()
+	    {
+	    if(length>0) std::fwrite(buffer,1,length,out);
+	    length=0;
+	    std::fflush(out);
+	    }
+	void write(const char* s,size_t n)
+	    {
+	    if(length+n>capacity)
+		{
+		flush();
+		if(n>=capacity)
+		    {
+		    std::fwrite(s,1,n,out);
+		    return;
+		    }
+		}
+	    std::memcpy(&buffer[length],s,n);
+	    length+=n;
+	    }
+	void write(const std::string& s)
+	    {
+	    write(s.data(),s.size());
+	    }
+	void write(char c)
+	    {
+	    if(length==capacity) flush();
+	    buffer[length++]=c;
+	    }
+	void write(long n)
+	    {
+	    char tmp[24];
+	    int i=sizeof(tmp);
+	    bool negative=n<0;
+	    unsigned long u=(negative?-(unsigned long)n:(unsigned long)n);
+	    do
+		{
+		tmp[--i]=(char)('0'+(u%10));
+		u/=10;
+		} while(u!=0);
+	    if(negative) tmp[--i]='-';
+	    write(&tmp[i],sizeof(tmp)-i);
+	    }
+    };
+
+#endif
@@ -8,11 +8,13 @@
  * WWW:
  *	http://plindenbaum.blogspot.com
  * Motivation:
- *	cut columns by finding the indexes in the header
+ *	cut columns by finding the indexes in the header. The columns are
+ *	selected by name, glob or regex, the rows by an expression on the
+ *	columns.
  * Compilation:
- *	 g++ -o colgrep -Wall -O3 colgrep
+ *	 g++ -o colgrep -Wall -O3 colgrep.cpp -lz -lpthread
  */
-#include <set>
+#include <map>
 #include <vector>
 #include <cstdio>
 #include <cstring>
@@ -23,116 +25,737 @@
 #include <algorithm>
 #include <cctype>
 #include <cassert>
+#include <deque>
+#include <stdexcept>
+#include <pthread.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include "linereader.h"
+#include "lineindex.h"
+#include "bufferedwriter.h"
 using namespace std;
 
+/* size of the blocks of lines projected by the threads */
+#define CHUNK_SIZE 4194304
+
 struct ToUpper {
    void operator()(char& c) { c = toupper(c); }
 };
 
+/** a condition on the fields of a row, the columns are resolved against the header */
+class Predicate
+    {
+    public:
+	virtual ~Predicate()
+	    {
+	    }
+	virtual bool eval(const vector<Field>& fields) const=0;
+	/** the largest index of a column used by the predicate */
+	virtual size_t maxIndex() const=0;
+    };
+
+/** 'column op value': numeric if the value is a number, else string. A missing or non-numeric field is false */
+class Comparison:public Predicate
+    {
+    public:
+	enum Op { lt, le, gt, ge, eq, ne };
+	size_t index;
+	Op op;
+	bool numeric;
+	double number;
+	string text;
+	template<typename T>
+	bool compare(const T& a,const T& b) const
+	    {
+	    switch(op)
+		{
+		case lt: return a< b;
+		case le: return a<= b;
+		case gt: return a> b;
+		case ge: return a>= b;
+		case eq: return a==b;
+		default: return a!=b;
+		}
+	    }
+	virtual bool eval(const vector<Field>& fields) const
+	    {
+	    if(index>=fields.size()) return false;
+	    const Field& f=fields[index];
+	    if(numeric)
+		{
+		double v;
+		if(!LineReader::toDouble(f,&v)) return false;
+		return compare(v,number);
+		}
+	    int c=memcmp(f.begin,text.data(),min(f.length,text.size()));
+	    if(c==0) c=(f.length< text.size()?-1:(f.length> text.size()?1:0));
+	    return compare(c,0);
+	    }
+	virtual size_t maxIndex() const
+	    {
+	    return index;
+	    }
+    };
+
+class AndOr:public Predicate
+    {
+    public:
+	bool is_and;
+	Predicate* left;
+	Predicate* right;
+	AndOr(bool is_and,Predicate* left,Predicate* right):is_and(is_and),left(left),right(right)
+	    {
+	    }
+	virtual ~AndOr()
+	    {
+	    delete left;
+	    delete right;
+	    }
+	virtual bool eval(const vector<Field>& fields) const
+	    {
+	    if(is_and) return left->eval(fields) && right->eval(fields);
+	    return left->eval(fields) || right->eval(fields);
+	    }
+	virtual size_t maxIndex() const
+	    {
+	    return max(left->maxIndex(),right->maxIndex());
+	    }
+    };
+
+class Not:public Predicate
+    {
+    public:
+	Predicate* child;
+	Not(Predicate* child):child(child)
+	    {
+	    }
+	virtual ~Not()
+	    {
+	    delete child;
+	    }
+	virtual bool eval(const vector<Field>& fields) const
+	    {
+	    return !child->eval(fields);
+	    }
+	virtual size_t maxIndex() const
+	    {
+	    return child->maxIndex();
+	    }
+    };
+
+/**
+ * parses a row expression:
+ *   expr := term ( ('or'|'||') term )*
+ *   term := factor ( ('and'|'&&') factor )*
+ *   factor := ('not'|'!') factor | '(' expr ')' | column op value
+ *   column := name | 'quoted name' | $index
+ *   op := < | <= | > | >= | == | = | !=
+ *   value := number | 'quoted string' | word
+ */
+class ExprParser
+    {
+    private:
+	const string& expr;
+	size_t pos;
+	map<string,size_t> header;
+	bool ignorecase;
+
+	void fail(const string& msg)
+	    {
+	    cerr << "Bad expression \""<< expr << "\" at " << (pos+1) << ": " << msg << endl;
+	    exit(EXIT_FAILURE);
+	    }
+	void skip()
+	    {
+	    while(pos< expr.size() && isspace(expr[pos])) ++pos;
+	    }
+	bool special(char c) const
+	    {
+	    return isspace(c) || strchr("()<>=!&|'\"",c)!=NULL;
+	    }
+	/** consumes 's' if it is the next token */
+	bool accept(const char* s)
+	    {
+	    skip();
+	    size_t n=strlen(s);
+	    if(expr.compare(pos,n,s)!=0) return false;
+	    /* a keyword is a whole word */
+	    if(isalpha(s[0]) && pos+n< expr.size() && !special(expr[pos+n])) return false;
+	    pos+=n;
+	    return true;
+	    }
+	/** a quoted string or a word, 'quoted' is set if it was quoted */
+	string word(bool* quoted)
+	    {
+	    skip();
+	    string w;
+	    *quoted=false;
+	    if(pos< expr.size() && (expr[pos]=='\'' || expr[pos]=='"'))
+		{
+		char q=expr[pos++];
+		size_t end=expr.find(q,pos);
+		if(end==string::npos) fail("unterminated string");
+		w=expr.substr(pos,end-pos);
+		pos=end+1;
+		*quoted=true;
+		return w;
+		}
+	    while(pos< expr.size() && !special(expr[pos])) w+=expr[pos++];
+	    if(w.empty()) fail("word expected");
+	    return w;
+	    }
+	Predicate* parseOr()
+	    {
+	    Predicate* p=parseAnd();
+	    while(accept("or") || accept("||")) p=new AndOr(false,p,parseAnd());
+	    return p;
+	    }
+	Predicate* parseAnd()
+	    {
+	    Predicate* p=parseFactor();
+	    while(accept("and") || accept("&&")) p=new AndOr(true,p,parseFactor());
+	    return p;
+	    }
+	Predicate* parseFactor()
+	    {
+	    if(accept("not") || accept("!")) return new Not(parseFactor());
+	    if(accept("("))
+		{
+		Predicate* p=parseOr();
+		if(!accept(")")) fail("')' expected");
+		return p;
+		}
+	    return parseComparison();
+	    }
+	Predicate* parseComparison()
+	    {
+	    Comparison* c=new Comparison;
+	    bool quoted;
+	    string column=word(&quoted);
+	    char* p2;
+	    if(!quoted && column.size()>1 && column[0]=='$')
+		{
+		long n=strtol(&column[1],&p2,10);
+		if(*p2!=0 || n<1) fail("bad column index "+column);
+		c->index=n-1;
+		}
+	    else
+		{
+		if(ignorecase) std::for_each(column.begin(),column.end(),ToUpper());
+		map<string,size_t>::iterator r=header.find(column);
+		if(r==header.end()) fail("unknown column "+column);
+		c->index=r->second;
+		}
+	    if(accept("<=")) c->op=Comparison::le;
+	    else if(accept(">=")) c->op=Comparison::ge;
+	    else if(accept("==")) c->op=Comparison::eq;
+	    else if(accept("!=")) c->op=Comparison::ne;
+	    else if(accept("<")) c->op=Comparison::lt;
+	    else if(accept(">")) c->op=Comparison::gt;
+	    else if(accept("=")) c->op=Comparison::eq;
+	    else fail("operator expected");
+	    c->text=word(&quoted);
+	    c->number=strtod(c->text.c_str(),&p2);
+	    c->numeric=(!quoted && *p2==0);
+	    return c;
+	    }
+    public:
+	ExprParser(const string& expr,const vector<Field>& names,bool ignorecase):expr(expr),pos(0),ignorecase(ignorecase)
+	    {
+	    /* a name found twice is the first column */
+	    for(size_t i=0;i< names.size();++i)
+		{
+		string s=names[i].str();
+		if(ignorecase) std::for_each(s.begin(),s.end(),ToUpper());
+		header.insert(make_pair(s,i));
+		}
+	    }
+	Predicate* parse()
+	    {
+	    Predicate* p=parseOr();
+	    skip();
+	    if(pos< expr.size()) fail("unexpected characters");
+	    return p;
+	    }
+    };
+
 
 class ColGrep
     {
     public:
+	/* a glob or a regex matched against the names of the header */
+	struct Pattern
+	    {
+	    bool is_regex;
+	    string pattern;
+	    regex_t re;
+	    /* order in the request */
+	    size_t rank;
+	    bool found;
+	    };
 	char delim;
-	set<string> columnnames;
+	/* exact names of the columns and their order in the request */
+	map<string,size_t> columnnames;
+	vector<Pattern> patterns;
+	size_t nRequests;
 	vector<bool> columnindex;
+	/* output in the order of the request: the indexes of the columns */
+	bool ordered;
+	vector<size_t> order;
+	/* the rows are printed if they match all the expressions */
+	vector<string> expressions;
+	Predicate* filter;
+	/* number of fields to split when the line is not projected on the fly */
+	size_t needed;
+	/* --rows and --key: the lines are found with the index of the file */
+	const LineIndex* index;
+	bool rows;
+	uint64_t row_start;
+	uint64_t row_end;
+	vector<string> keys;
 	bool inverse;
 	bool printIndexesAndExit;
 	bool ignorecase;
+	/* threads inflating a BGZF input and projecting the lines */
+	int nthreads;
+
+	/* a block of lines and its projection */
+	struct Chunk
+	    {
+	    enum { free_chunk, todo, done } state;
+	    string input;
+	    string output;
+	    vector<Field> fields;
+	    void write(const char* s,size_t n)
+		{
+		output.append(s,n);
+		}
+	    void write(char c)
+		{
+		output+=c;
+		}
+	    };
+	/* the chunks waiting for a thread */
+	struct WorkQueue
+	    {
+	    ColGrep* owner;
+	    deque<Chunk*> todo;
+	    pthread_mutex_t mutex;
+	    pthread_cond_t cond_todo;
+	    pthread_cond_t cond_done;
+	    bool finished;
+	    };
 
 	ColGrep():delim('\t')
 	    {
+	    nRequests=0;
+	    ordered=false;
+	    filter=NULL;
+	    needed=0;
+	    index=NULL;
+	    rows=false;
+	    row_start=0;
+	    row_end=0;
 	    inverse=false;
 	    printIndexesAndExit=false;
 	    ignorecase=false;
+	    nthreads=1;
+	    }
+	~ColGrep()
+	    {
+	    delete filter;
+	    for(size_t i=0;i< patterns.size();++i)
+		{
+		if(patterns[i].is_regex) ::regfree(&patterns[i].re);
+		}
+	    }
+
+	void addName(const string& name)
+	    {
+	    /* a name requested twice keeps its first rank */
+	    columnnames.insert(make_pair(name,nRequests++));
+	    }
+
+	/** adds the names of a file, one per line */
+	void addNames(const char* filename)
+	    {
+	    ifstream in(filename);
+	    if(!in.is_open())
+		{
+		cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+		exit(EXIT_FAILURE);
+		}
+	    string line;
+	    while(getline(in,line))
+		{
+		if(!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+		if(line.empty()) continue;
+		addName(line);
+		}
+	    }
+
+	/** glob or regex, the regexes are compiled by compile() once the options are known */
+	void addPattern(const char* pattern,bool is_regex)
+	    {
+	    Pattern p;
+	    p.is_regex=is_regex;
+	    p.pattern.assign(pattern);
+	    p.rank=nRequests++;
+	    p.found=false;
+	    patterns.push_back(p);
 	    }
 
-	void split(const string& line,vector<string>& tokens)
+	void compile()
 	    {
-	    size_t prev=0;
-	    size_t i=0;
-	    tokens.clear();
-	    assert(tokens.empty());
-	    while(i<=line.size())
+	    if(ignorecase)
 		{
-		if(i==line.size() || line[i]==delim)
+		map<string,size_t> colsi;
+		for(map<string,size_t>::iterator r=columnnames.begin();r!=columnnames.end();++r)
 		    {
-		    tokens.push_back(line.substr(prev,i-prev));
-		    if(i==line.size()) break;
-		    prev=i+1;
+		    string s(r->first);
+		    std::for_each(s.begin(),s.end(),ToUpper());
+		    map<string,size_t>::iterator r2=colsi.find(s);
+		    if(r2==colsi.end()) colsi.insert(make_pair(s,r->second));
+		    else r2->second=min(r2->second,r->second);
+		    }
+		columnnames.swap(colsi);
+		}
+	    for(size_t i=0;i< patterns.size();++i)
+		{
+		Pattern& p=patterns[i];
+		if(!p.is_regex) continue;
+		int err=::regcomp(&p.re,p.pattern.c_str(),REG_EXTENDED|REG_NOSUB|(ignorecase?REG_ICASE:0));
+		if(err!=0)
+		    {
+		    char msg[256];
+		    ::regerror(err,&p.re,msg,sizeof(msg));
+		    cerr << "Bad regex \""<< p.pattern << "\" : " << msg << endl;
+		    exit(EXIT_FAILURE);
 		    }
-		++i;
 		}
 	    }
 
-	void run(FILE* in)
+	bool matches(const Pattern& p,const string& name) const
 	    {
-	    size_t nLine=0;
-	    string line;
-	    vector<string> tokens;
-	    while(!feof(in))
+	    if(p.is_regex) return ::regexec(&p.re,name.c_str(),0,NULL,0)==0;
+	    return ::fnmatch(p.pattern.c_str(),name.c_str(),ignorecase?FNM_CASEFOLD:0)==0;
+	    }
+
+	/** the selection is compiled against the header into 'columnindex' (and 'order') */
+	void resolve(const vector<Field>& header)
+	    {
+	    vector<pair<size_t,size_t> > ranks;
+	    for(size_t i=0;i< header.size();++i)
 		{
-		int c;
-		line.clear();
-		while((c=fgetc(in))!=EOF && c!='\n')
+		string head=header[i].str();
+		bool found=false;
+		size_t rank=0;
+		for(size_t j=0;j< patterns.size();++j)
 		    {
-		    line+=c;
+		    Pattern& p=patterns[j];
+		    if(!matches(p,head)) continue;
+		    p.found=true;
+		    if(!found || p.rank< rank) rank=p.rank;
+		    found=true;
 		    }
-		++nLine;
-
+		if(ignorecase)
+		    {
+		    std::for_each(head.begin(),head.end(),ToUpper());
+		    }
+		map<string,size_t>::iterator r=columnnames.find(head);
+		if(r!=columnnames.end())
+		    {
+		    if(!found || r->second< rank) rank=r->second;
+		    found=true;
+		    columnnames.erase(r);
+		    }
+		if(!found) continue;
+		columnindex.resize(i+1,false);
+		columnindex[i]=true;
+		ranks.push_back(make_pair(rank,i));
+		}
+	    if(ordered)
+		{
+		std::sort(ranks.begin(),ranks.end());
+		for(size_t i=0;i< ranks.size();++i) order.push_back(ranks[i].second);
+		}
+	    for(size_t i=0;i< expressions.size();++i)
+		{
+		Predicate* p=ExprParser(expressions[i],header,ignorecase).parse();
+		filter=(filter==NULL?p:new AndOr(true,filter,p));
+		}
+	    needed=columnindex.size();
+	    if(filter!=NULL) needed=max(needed,filter->maxIndex()+1);
+	    if(inverse) needed=(size_t)-1;
+	    }
 
-		split(line,tokens);
+	/** true if the field 'i' is printed */
+	bool selected(size_t i) const
+	    {
+	    return (i<columnindex.size() && columnindex[i])==!inverse;
+	    }
 
-		if(nLine==1)
+	/**
+	 * prints the selected fields of a line: the delimiters are found with
+	 * memchr, the fields are written without copy and the line is not
+	 * scanned after the last selected column.
+	 */
+	template<typename Out>
+	void project(const Field& line,Out& out,vector<Field>& fields,bool header=false)
+	    {
+	    if(!order.empty() || (filter!=NULL && !header))
+		{
+		splitFields(line,fields);
+		if(!header && filter!=NULL && !filter->eval(fields)) return;
+		printFields(fields,out);
+		return;
+		}
+	    const char* p=line.begin;
+	    const char* stop=line.begin+line.length;
+	    bool first=true;
+	    for(size_t i=0;;++i)
+		{
+		if(!inverse && i>=columnindex.size()) break;
+		const char* q=(const char*)memchr(p,delim,stop-p);
+		const char* end=(q==NULL?stop:q);
+		if(selected(i))
 		    {
-		    for(size_t i=0;i< tokens.size();++i)
-			{
-			string head=tokens[i];
-			if(ignorecase)
-			    {
-			    std::for_each(head.begin(),head.end(),ToUpper());
-			    }
-			set<string>::iterator r=columnnames.find(head);
-			if(r==columnnames.end()) continue;
-			columnnames.erase(r);
-			columnindex.resize(i+1,false);
-			columnindex[i]=true;
-			}
-		    for(set<string>::iterator i=columnnames.begin();
-			i!=columnnames.end();
-			++i)
-		    	{
-			cerr << "Warning: could not find column \""<< (*i)<< "\" in "
-				<< line << endl;
-		    	}
-		    if(printIndexesAndExit)
-			{
-			bool first=true;
-			for(size_t i=0;i< columnindex.size();++i)
-			    {
-			    if(!columnindex[i]) continue;
-			    if(!first) cout <<",";
-			    first=false;
-			    cout << (i+1);
-			    }
-			cout << endl;
-			return;
-			}
+		    if(!first) out.write(delim);
+		    first=false;
+		    out.write(p,end-p);
 		    }
+		if(q==NULL) break;
+		p=q+1;
+		}
+	    out.write('\n');
+	    }
 
+	/** the fields up to the last one selected or used by the filter */
+	void splitFields(const Field& line,vector<Field>& fields) const
+	    {
+	    const char* p=line.begin;
+	    const char* stop=line.begin+line.length;
+	    fields.clear();
+	    while(fields.size()< needed)
+		{
+		const char* q=(const char*)memchr(p,delim,stop-p);
+		Field f;
+		f.begin=p;
+		f.length=(q==NULL?stop:q)-p;
+		fields.push_back(f);
+		if(q==NULL) break;
+		p=q+1;
+		}
+	    }
+
+	/** prints the selected fields, in the order of the request if any */
+	template<typename Out>
+	void printFields(const vector<Field>& fields,Out& out) const
+	    {
 	    bool first=true;
-	    for(size_t i=0;i< tokens.size();++i)
+	    size_t n=(order.empty()?fields.size():order.size());
+	    for(size_t i=0;i< n;++i)
+		{
+		size_t index=i;
+		if(!order.empty()) index=order[i];
+		else if(!selected(i)) continue;
+		if(index>=fields.size()) continue;
+		if(!first) out.write(delim);
+		first=false;
+		out.write(fields[index].begin,fields[index].length);
+		}
+	    out.write('\n');
+	    }
+
+	/** projects all the lines of a chunk, each one ends with '\n' */
+	void project(Chunk* c)
+	    {
+	    const char* p=c->input.data();
+	    const char* stop=p+c->input.size();
+	    c->output.clear();
+	    while(p< stop)
+		{
+		const char* q=(const char*)memchr(p,'\n',stop-p);
+		Field line;
+		line.begin=p;
+		line.length=q-p;
+		project(line,*c,c->fields);
+		p=q+1;
+		}
+	    }
+
+	static void* work(void* arg)
+	    {
+	    WorkQueue* q=(WorkQueue*)arg;
+	    for(;;)
+		{
+		::pthread_mutex_lock(&q->mutex);
+		while(!q->finished && q->todo.empty())
+		    {
+		    ::pthread_cond_wait(&q->cond_todo,&q->mutex);
+		    }
+		if(q->todo.empty())
+		    {
+		    ::pthread_mutex_unlock(&q->mutex);
+		    break;
+		    }
+		Chunk* c=q->todo.front();
+		q->todo.pop_front();
+		::pthread_mutex_unlock(&q->mutex);
+
+		q->owner->project(c);
+
+		::pthread_mutex_lock(&q->mutex);
+		c->state=Chunk::done;
+		::pthread_cond_broadcast(&q->cond_done);
+		::pthread_mutex_unlock(&q->mutex);
+		}
+	    return NULL;
+	    }
+
+	/** reads the next block of lines into 'c' and hands it to the threads */
+	static void submit(LineReader& reader,WorkQueue& q,Chunk* c)
+	    {
+	    c->input.clear();
+	    if(!reader.next(c->input,CHUNK_SIZE))
 		{
-		if((i<columnindex.size() && columnindex[i])==!inverse)
+		c->state=Chunk::free_chunk;
+		return;
+		}
+	    ::pthread_mutex_lock(&q.mutex);
+	    c->state=Chunk::todo;
+	    q.todo.push_back(c);
+	    ::pthread_cond_signal(&q.cond_todo);
+	    ::pthread_mutex_unlock(&q.mutex);
+	    }
+
+	/**
+	 * the lines after the header are read by blocks, projected by the
+	 * threads and written in the order of the input: the blocks are a
+	 * ring, a block is refilled once its output is written.
+	 */
+	void runParallel(LineReader& reader,BufferedWriter& out)
+	    {
+	    WorkQueue q;
+	    q.owner=this;
+	    q.finished=false;
+	    ::pthread_mutex_init(&q.mutex,NULL);
+	    ::pthread_cond_init(&q.cond_todo,NULL);
+	    ::pthread_cond_init(&q.cond_done,NULL);
+	    vector<pthread_t> threads(nthreads);
+	    for(size_t i=0;i< threads.size();++i)
+		{
+		if(::pthread_create(&threads[i],NULL,ColGrep::work,&q)!=0)
 		    {
-		    if(!first) cout << delim;
+		    throw runtime_error("Cannot create thread");
+		    }
+		}
+	    vector<Chunk> chunks(2*nthreads);
+	    for(size_t i=0;i< chunks.size();++i) submit(reader,q,&chunks[i]);
+	    for(size_t head=0;;head=(head+1)%chunks.size())
+		{
+		Chunk* c=&chunks[head];
+		::pthread_mutex_lock(&q.mutex);
+		while(c->state==Chunk::todo) ::pthread_cond_wait(&q.cond_done,&q.mutex);
+		::pthread_mutex_unlock(&q.mutex);
+		if(c->state==Chunk::free_chunk) break;
+		out.write(c->output);
+		submit(reader,q,c);
+		}
+	    ::pthread_mutex_lock(&q.mutex);
+	    q.finished=true;
+	    ::pthread_cond_broadcast(&q.cond_todo);
+	    ::pthread_mutex_unlock(&q.mutex);
+	    for(size_t i=0;i< threads.size();++i) ::pthread_join(threads[i],NULL);
+	    ::pthread_cond_destroy(&q.cond_done);
+	    ::pthread_cond_destroy(&q.cond_todo);
+	    ::pthread_mutex_destroy(&q.mutex);
+	    }
+
+	/** prints the rows asked by --rows, then by --key */
+	void runIndexed(BgzfReader& in,LineReader& reader,BufferedWriter& out,vector<Field>& fields)
+	    {
+	    Field line;
+	    /* the line 0 is the header: the row n is the line n */
+	    if(rows && row_start< index->size() && index->seek(in,reader,row_start))
+		{
+		for(uint64_t i=row_start;i<=row_end && reader.next(line);++i)
+		    {
+		    project(line,out,fields);
+		    }
+		}
+	    vector<uint64_t> lines;
+	    for(size_t k=0;k< keys.size();++k)
+		{
+		index->find(keys[k],lines);
+		for(size_t i=0;i< lines.size();++i)
+		    {
+		    if(lines[i]==0 || !index->seek(in,reader,lines[i]) || !reader.next(line)) continue;
+		    const char* q=(const char*)memchr(line.begin,delim,line.length);
+		    Field key;
+		    key.begin=line.begin;
+		    key.length=(q==NULL?line.length:q-line.begin);
+		    if(!key.equals(keys[k])) continue;
+		    project(line,out,fields);
+		    }
+		}
+	    }
+
+	void run(BgzfReader& in)
+	    {
+	    LineReader reader(in);
+	    BufferedWriter out(stdout);
+	    vector<Field> tokens;
+	    Field line;
+	    if(!reader.next(line)) return;
+	    LineReader::split(line,delim,tokens);
+	    resolve(tokens);
+	    for(map<string,size_t>::iterator i=columnnames.begin();
+		i!=columnnames.end();
+		++i)
+		{
+		cerr << "Warning: could not find column \""<< i->first<< "\" in "
+			<< line.str() << endl;
+		}
+	    for(size_t i=0;i< patterns.size();++i)
+		{
+		if(patterns[i].found) continue;
+		cerr << "Warning: no column matching \""<< patterns[i].pattern<< "\" in "
+			<< line.str() << endl;
+		}
+	    if(printIndexesAndExit)
+		{
+		bool first=true;
+		for(size_t i=0;i< columnindex.size();++i)
+		    {
+		    size_t index=i;
+		    if(ordered)
+			{
+			if(i>=order.size()) break;
+			index=order[i];
+			}
+		    else if(!columnindex[i]) continue;
+		    if(!first) out.write(',');
 		    first=false;
-		    cout <<tokens[i];
+		    out.write((long)(index+1));
 		    }
+		out.write('\n');
+		return;
+		}
+	    vector<Field> fields;
+	    project(line,out,fields,true);
+	    if(index!=NULL)
+		{
+		runIndexed(in,reader,out,fields);
+		return;
 		}
-	    cout << endl;
+	    if(nthreads>1)
+		{
+		runParallel(reader,out);
+		return;
+		}
+	    while(reader.next(line)) project(line,out,fields);
 	    }
-	}
     };
 
 int main(int argc,char** argv)
@@ -150,8 +773,23 @@ int main(int argc,char** argv)
 			cerr << "  -d (char) delimiter (default is TAB)\n";
 			cerr << "  -p print indexes and exit\n";
 			cerr << "  -c <string> add column in selection (can be called multiple time)\n";
+			cerr << "  -g <glob> add the columns matching a glob, e.g. 'S*' (can be called multiple time)\n";
+			cerr << "  -r <regex> add the columns matching an extended regex (can be called multiple time)\n";
+			cerr << "  -f <file> add the columns listed in a file, one per line\n";
+			cerr << "  -e <expr> print the rows matching the expression (can be called multiple time: and).\n"
+				"     e.g. -e 'pvalue < 1e-5 and (chrom == chr1 or $2 != \"NA\")'\n"
+				"     operators: < <= > >= == != and or not ( ). A column is a name or $index. The\n"
+				"     comparison is numeric if the value is a number (a non-numeric field is false),\n"
+				"     else string. Quote a name or a value with ' or \".\n";
+			cerr << "  --rows A-B print the rows A to B (1-based, the header is not a row; 'A' or 'A-' are allowed)\n";
+			cerr << "  --key <string> print the rows whose first column is the key (can be called multiple time)\n";
+			cerr << "     --rows and --key use the index file.lidx, created if missing or out of date.\n"
+				"     The file must be plain or BGZF.\n";
+			cerr << "  --ordered print the columns in the order of -c/-g/-r/-f instead of the header\n";
 			cerr << "  -i ignore case\n";
-			cerr << "(stdin|file)\n";
+			cerr << "  --threads (int) number of threads inflating a BGZF input and cutting the columns.\n"
+				"     The lines keep the order of the input (default 1).\n";
+			cerr << "(stdin|file|file.gz)\n";
 			return (EXIT_FAILURE);
                         }
                 else if(strcmp(argv[optind],"-v")==0 )
@@ -166,9 +804,62 @@ int main(int argc,char** argv)
 		       {
 		       app.printIndexesAndExit=true;
 		       }
+                else if(strcmp(argv[optind],"--threads")==0 && optind+1<argc)
+		       {
+		       char* p2;
+		       app.nthreads=(int)strtol(argv[++optind],&p2,10);
+		       if(app.nthreads<1 || *p2!=0)
+			   {
+			   cerr << "Bad number of threads\n";
+			   return EXIT_FAILURE;
+			   }
+		       }
                 else if(strcmp(argv[optind],"-c")==0 && optind+1<argc)
 		       {
-		       app.columnnames.insert(argv[++optind]);
+		       app.addName(argv[++optind]);
+		       }
+                else if(strcmp(argv[optind],"-g")==0 && optind+1<argc)
+		       {
+		       app.addPattern(argv[++optind],false);
+		       }
+                else if(strcmp(argv[optind],"-r")==0 && optind+1<argc)
+		       {
+		       app.addPattern(argv[++optind],true);
+		       }
+                else if(strcmp(argv[optind],"-f")==0 && optind+1<argc)
+		       {
+		       app.addNames(argv[++optind]);
+		       }
+                else if(strcmp(argv[optind],"-e")==0 && optind+1<argc)
+		       {
+		       app.expressions.push_back(argv[++optind]);
+		       }
+                else if(strcmp(argv[optind],"--rows")==0 && optind+1<argc)
+		       {
+		       char* p=argv[++optind];
+		       char* p2;
+		       app.rows=true;
+		       app.row_start=strtoull(p,&p2,10);
+		       app.row_end=app.row_start;
+		       if(*p2=='-')
+			   {
+			   p=p2+1;
+			   p2=p;
+			   app.row_end=(*p==0?(uint64_t)-1:strtoull(p,&p2,10));
+			   }
+		       if(*p2!=0 || app.row_start<1 || app.row_end< app.row_start)
+			   {
+			   cerr << "Bad rows " << argv[optind] << "\n";
+			   return EXIT_FAILURE;
+			   }
+		       }
+                else if(strcmp(argv[optind],"--key")==0 && optind+1<argc)
+		       {
+		       app.keys.push_back(argv[++optind]);
+		       }
+                else if(strcmp(argv[optind],"--ordered")==0)
+		       {
+		       app.ordered=true;
 		       }
                 else if(std::strcmp(argv[optind],"-d")==0 && optind+1< argc)
 			{
@@ -196,40 +887,65 @@ int main(int argc,char** argv)
                         }
                 ++optind;
                 }
-       if(app.ignorecase)
+       if(app.ordered && app.inverse)
+	   {
+	   cerr << "--ordered cannot be used with -v\n";
+	   return EXIT_FAILURE;
+	   }
+       app.compile();
+       LineIndex index;
+       if(app.rows || !app.keys.empty())
 	   {
-	   set<string> colsi;
-	   for(set<string>::iterator r=app.columnnames.begin();r!=app.columnnames.end();++r)
+	   if(optind+1!=argc)
+	       {
+	       cerr << "--rows and --key need a file\n";
+	       return EXIT_FAILURE;
+	       }
+	   try
+	       {
+	       index.open(argv[optind],app.delim,app.nthreads);
+	       }
+	   catch(std::exception& err)
 	       {
-	       string s(*r);
-	       std::for_each(s.begin(),s.end(),ToUpper());
-	       colsi.insert(s);
+	       cerr << "Cannot index " << argv[optind] << ": " << err.what() << endl;
+	       return EXIT_FAILURE;
 	       }
-	   app.columnnames.clear();
-	   app.columnnames.insert(colsi.begin(),colsi.end());
+	   app.index=&index;
 	   }
-        if(optind==argc)
-                {
-                app.run(stdin);
-                }
-        else if(optind+1==argc)
-                {
-		FILE* in=NULL;
-		char* fname=argv[optind++];
-		errno=0;
-		in=fopen(fname,"r");
-		if(in==NULL)
+        try
+            {
+            if(optind==argc)
+                    {
+                    BgzfReader in(stdin,app.nthreads);
+                    app.run(in);
+                    }
+            else if(optind+1==argc)
+                    {
+		    FILE* in=NULL;
+		    char* fname=argv[optind++];
+		    errno=0;
+		    in=fopen(fname,"rb");
+		    if(in==NULL)
+			    {
+			    fprintf(stderr,"Cannot open %s : %s\n",fname,strerror(errno));
+			    exit( EXIT_FAILURE);
+			    }
+
 			{
-			fprintf(stderr,"Cannot open %s : %s\n",fname,strerror(errno));
-			exit( EXIT_FAILURE);
+			BgzfReader reader(in,app.nthreads);
+			app.run(reader);
 			}
-
-		app.run(in);
-		fclose(in);
+		    fclose(in);
+                    }
+            else
+                {
+                cerr << "Illegal number of arguments\n";
+                return EXIT_FAILURE;
                 }
-        else
+            }
+        catch(std::exception& err)
             {
-            cerr << "Illegal number of arguments\n";
+            cerr << err.what() << endl;
             return EXIT_FAILURE;
             }
         return EXIT_SUCCESS;
@@ -0,0 +1,264 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	random access to the lines of a large table. The index 'file.lidx'
+ *	holds the offset of one line every LINE_INDEX_STEP lines (a BGZF
+ *	virtual offset, compressed block offset<<16|offset in the block, for
+ *	a BGZF file) and, sorted, the hash of the first column of each line.
+ *	It is built by a single scan of the file and saved next to it.
+ *	Gzip files that are not BGZF cannot be indexed.
+ *	Format (native byte order): "LINEIDX1", the stamp of the indexed
+ *	file {uint64 size,int64 mtime seconds,int64 mtime nanoseconds,uint64
+ *	delimiter}, uint64 step, uint64 number of lines, uint64 number of
+ *	offsets, the offsets, uint64 number of keys, the keys {uint64 hash,
+ *	uint64 line}. The index is rebuilt when its stamp differs from the file.
+ */
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "linereader.h"
+
+#define LINE_INDEX_MAGIC "LINEIDX1"
+#define LINE_INDEX_STEP 1000
+
+class LineIndex
+    {
+    private:
+	struct Key
+	    {
+	    uint64_t hash;
+	    uint64_t line;
+	    bool operator< (const Key& cp) const
+		{
+		if(hash!=cp.hash) return hash< cp.hash;
+		return line< cp.line;
+		}
+	    };
+	/* what the index was built from */
+	struct Stamp
+	    {
+	    uint64_t size;
+	    int64_t mtime_sec;
+	    int64_t mtime_nsec;
+	    uint64_t delim;
+	    bool operator== (const Stamp& cp) const
+		{
+		return size==cp.size && mtime_sec==cp.mtime_sec &&
+		    mtime_nsec==cp.mtime_nsec && delim==cp.delim;
+		}
+	    };
+	Stamp stamp;
+	uint64_t step;
+	uint64_t nLines;
+	std::vector<uint64_t> offsets;
+	std::vector<Key> keys;
+
+	/* FNV-1a */
+	static uint64_t hash(const char* s,size_t n)
+	    {
+	    uint64_t h=14695981039346656037ULL;
+	    for(size_t i=0;i< n;++i)
+		{
+		h^=(unsigned char)s[i];
+		h*=1099511628211ULL;
+		}
+	    return h;
+	    }
+	void addKey(const std::string& key,uint64_t line)
+	    {
+	    Key k;
+	    k.hash=hash(key.data(),key.size());
+	    k.line=line;
+	    keys.push_back(k);
+	    }
+	template<typename T>
+	static bool readArray(FILE* in,std::vector<T>& v)
+	    {
+	    uint64_t n;
+	    if(std::fread(&n,sizeof(uint64_t),1,in)!=1) return false;
+	    v.resize(n);
+	    return n==0 || std::fread(&v[0],sizeof(T),n,in)==n;
+	    }
+	template<typename T>
+	static bool writeArray(FILE* out,const std::vector<T>& v)
+	    {
+	    uint64_t n=v.size();
+	    if(std::fwrite(&n,sizeof(uint64_t),1,out)!=1) return false;
+	    return n==0 || std::fwrite(&v[0],sizeof(T),n,out)==n;
+	    }
+    public:
+	LineIndex():step(LINE_INDEX_STEP),nLines(0)
+	    {
+	    std::memset(&stamp,0,sizeof(Stamp));
+	    }
+
+	uint64_t size() const
+	    {
+	    return nLines;
+	    }
+
+	/** scans the whole input, the key of a line is its first field */
+	void build(BgzfReader& in,char delim)
+	    {
+	    std::vector<char> buffer(65536);
+	    std::string key;
+	    bool at_start=true;
+	    bool in_key=false;
+	    offsets.clear();
+	    keys.clear();
+	    nLines=0;
+	    for(;;)
+		{
+		/* a read never crosses a BGZF block: the offsets in the buffer are consecutive */
+		uint64_t offset=in.tell();
+		int n=in.read(&buffer[0],buffer.size());
+		if(n<=0) break;
+		const char* p=&buffer[0];
+		const char* stop=p+n;
+		while(p< stop)
+		    {
+		    if(at_start)
+			{
+			if(nLines%step==0) offsets.push_back(offset+(p-&buffer[0]));
+			at_start=false;
+			in_key=true;
+			key.clear();
+			}
+		    if(in_key)
+			{
+			const char* q=p;
+			while(q< stop && *q!=delim && *q!='\n') ++q;
+			key.append(p,q-p);
+			p=q;
+			if(p==stop) break;
+			in_key=false;
+			addKey(key,nLines);
+			}
+		    const char* q=(const char*)std::memchr(p,'\n',stop-p);
+		    if(q==NULL) break;
+		    p=q+1;
+		    ++nLines;
+		    at_start=true;
+		    }
+		}
+	    if(!at_start)
+		{
+		if(in_key) addKey(key,nLines);
+		++nLines;
+		}
+	    std::sort(keys.begin(),keys.end());
+	    }
+
+	/** false if the index cannot be read or was not built from a file with the stamp 'expect' */
+	bool load(const std::string& filename,const Stamp& expect)
+	    {
+	    FILE* in=std::fopen(filename.c_str(),"rb");
+	    if(in==NULL) return false;
+	    char magic[8];
+	    bool ok=std::fread(magic,1,8,in)==8 &&
+		std::memcmp(magic,LINE_INDEX_MAGIC,8)==0 &&
+		std::fread(&stamp,sizeof(Stamp),1,in)==1 &&
+		stamp==expect &&
+		std::fread(&step,sizeof(uint64_t),1,in)==1 &&
+		std::fread(&nLines,sizeof(uint64_t),1,in)==1 &&
+		readArray(in,offsets) &&
+		readArray(in,keys) &&
+		step>0;
+	    std::fclose(in);
+	    return ok;
+	    }
+
+	bool save(const std::string& filename) const
+	    {
+	    FILE* out=std::fopen(filename.c_str(),"wb");
+	    if(out==NULL) return false;
+	    bool ok=std::fwrite(LINE_INDEX_MAGIC,1,8,out)==8 &&
+		std::fwrite(&stamp,sizeof(Stamp),1,out)==1 &&
+		std::fwrite(&step,sizeof(uint64_t),1,out)==1 &&
+		std::fwrite(&nLines,sizeof(uint64_t),1,out)==1 &&
+		writeArray(out,offsets) &&
+		writeArray(out,keys);
+	    if(std::fclose(out)!=0) ok=false;
+	    if(!ok) std::remove(filename.c_str());
+	    return ok;
+	    }
+
+	/**
+	 * loads 'filename.lidx' or, if it is missing or was built from another
+	 * version of the file (size, mtime) or with another delimiter, builds
+	 * the index and tries to save it.
+	 */
+	void open(const std::string& filename,char delim,int nthreads)
+	    {
+	    std::string indexname=filename+".lidx";
+	    struct stat st;
+	    if(::stat(filename.c_str(),&st)!=0) throw std::runtime_error("Cannot stat "+filename);
+	    Stamp current;
+	    current.size=st.st_size;
+	    current.mtime_sec=st.st_mtim.tv_sec;
+	    current.mtime_nsec=st.st_mtim.tv_nsec;
+	    current.delim=(unsigned char)delim;
+	    if(load(indexname,current)) return;
+	    stamp=current;
+	    FILE* in=std::fopen(filename.c_str(),"rb");
+	    if(in==NULL) throw std::runtime_error("Cannot open "+filename);
+	    try
+		{
+		BgzfReader reader(in,nthreads);
+		build(reader,delim);
+		}
+	    catch(...)
+		{
+		std::fclose(in);
+		throw;
+		}
+	    std::fclose(in);
+	    if(!save(indexname))
+		{
+		std::fprintf(stderr,"Warning: cannot save the index %s\n",indexname.c_str());
+		}
+	    }
+
+	/** moves 'in' to the line 'line' (0-based), the next line of 'reader' is that line. False if there is no such line */
+	bool seek(BgzfReader& in,LineReader& reader,uint64_t line) const
+	    {
+	    if(line>=nLines) return false;
+	    in.seek(offsets[line/step]);
+	    reader.reset();
+	    Field skip;
+	    for(uint64_t i=0;i< line%step;++i)
+		{
+		if(!reader.next(skip)) return false;
+		}
+	    return true;
+	    }
+
+	/** the lines (0-based, sorted) whose first field may be 'key': the caller checks the field */
+	void find(const std::string& key,std::vector<uint64_t>& lines) const
+	    {
+	    Key k;
+	    k.hash=hash(key.data(),key.size());
+	    k.line=0;
+	    lines.clear();
+	    for(std::vector<Key>::const_iterator r=std::lower_bound(keys.begin(),keys.end(),k);
+		r!=keys.end() && r->hash==k.hash;
+		++r)
+		{
+		lines.push_back(r->line);
+		}
+	    }
+    };
+
+#endif
@@ -0,0 +1,173 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	input scanner: the input is read by large blocks from a BgzfReader,
+ *	the lines and the fields are found with memchr and are returned as
+ *	pointers in the block, without copy. Numbers are parsed in place.
+ */
+#ifndef LINE_READER_H
+#define LINE_READER_H
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "bgzfreader.h"
+
+/** a line or a field in the buffer of a LineReader, valid until the next line is read */
+struct Field
+    {
+    const char* begin;
+    size_t length;
+    std::string str() const
+	{
+	return std::string(begin,length);
+	}
+    bool equals(const std::string& s) const
+	{
+	return s.size()==length && std::memcmp(s.data(),begin,length)==0;
+	}
+    };
+
+class LineReader
+    {
+    private:
+	BgzfReader& in;
+	char* buffer;
+	size_t capacity;
+	/* the unread bytes are buffer[start,end[ */
+	size_t start;
+	size_t end;
+	bool eof;
+	/* copies are not allowed */
+	LineReader(const LineReader&);
+	LineReader& operator=(const LineReader&);
+    public:
+	LineReader(BgzfReader& in,size_t capacity=1048576):
+	    in(in),buffer((char*)std::malloc(capacity+1)),capacity(capacity),start(0),end(0),eof(false)
+	    {
+	    if(buffer==NULL) throw std::runtime_error("out of memory");
+	    }
+	~LineReader()
+	    {
+	    std::free(buffer);
+	    }
+
+	/** forgets the buffered bytes, after the BgzfReader has been moved */
+	void reset()
+	    {
+	    start=0;
+	    end=0;
+	    eof=false;
+	    }
+
+	/**
+	 * next line without its '\n', false at the end of the input. The line
+	 * is nul-terminated in the buffer.
+	 */
+	bool next(Field& line)
+	    {
+	    for(;;)
+		{
+		char* p=(char*)std::memchr(&buffer[start],'\n',end-start);
+		if(p!=NULL || (eof && start< end))
+		    {
+		    if(p==NULL) p=&buffer[end];
+		    *p=0;
+		    line.begin=&buffer[start];
+		    line.length=p-line.begin;
+		    start=std::min((size_t)(p-buffer)+1,end);
+		    return true;
+		    }
+		if(eof) return false;
+		/* keep the incomplete line at the beginning of the buffer */
+		std::memmove(buffer,&buffer[start],end-start);
+		end-=start;
+		start=0;
+		if(end==capacity)
+		    {
+		    char* b=(char*)std::realloc(buffer,capacity*2+1);
+		    if(b==NULL) throw std::runtime_error("out of memory");
+		    buffer=b;
+		    capacity*=2;
+		    }
+		int n=in.read(&buffer[end],capacity-end);
+		if(n==0) eof=true;
+		end+=n;
+		}
+	    }
+
+	/** appends whole lines, each one followed by '\n', until 'block' holds 'size' bytes. False at the end of the input */
+	bool next(std::string& block,size_t size)
+	    {
+	    Field line;
+	    bool found=false;
+	    while(block.size()< size && next(line))
+		{
+		block.append(line.begin,line.length);
+		block+='\n';
+		found=true;
+		}
+	    return found;
+	    }
+
+	/** splits 'line' on 'delim' */
+	static void split(const Field& line,char delim,std::vector<Field>& fields)
+	    {
+	    const char* p=line.begin;
+	    const char* stop=line.begin+line.length;
+	    fields.clear();
+	    for(;;)
+		{
+		const char* q=(const char*)std::memchr(p,delim,stop-p);
+		Field f;
+		f.begin=p;
+		f.length=(q==NULL?stop:q)-p;
+		fields.push_back(f);
+		if(q==NULL) break;
+		p=q+1;
+		}
+	    }
+
+	/** parses a whole field as a decimal integer */
+	static bool toLong(const Field& f,long* value)
+	    {
+	    const char* p=f.begin;
+	    const char* stop=f.begin+f.length;
+	    bool negative=false;
+	    if(p< stop && (*p=='-' || *p=='+'))
+		{
+		negative=(*p=='-');
+		++p;
+		}
+	    if(p==stop) return false;
+	    unsigned long n=0;
+	    for(;p< stop;++p)
+		{
+		unsigned int d=(unsigned int)(*p-'0');
+		if(d>9) return false;
+		if(n>(ULONG_MAX-d)/10) return false;
+		n=n*10+d;
+		}
+	    if(n>(unsigned long)LONG_MAX+(negative?1:0)) return false;
+	    *value=(negative?(long)(0UL-n):(long)n);
+	    return true;
+	    }
+
+	/** parses a whole field as a double, in place: the field is followed by a delimiter or the end of the line */
+	static bool toDouble(const Field& f,double* value)
+	    {
+	    if(f.length==0) return false;
+	    char* p2;
+	    *value=std::strtod(f.begin,&p2);
+	    return p2==f.begin+f.length;
+	    }
+    };
+
+#endif
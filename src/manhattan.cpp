@@ -16,11 +16,17 @@
 #include <cfloat>
 #include <cstdio>
 #include <iostream>
+#include <fstream>
 #include <zlib.h>
 #include <sstream>
 #include <algorithm>
 #include <cassert>
 #include <stdint.h>
+#include <deque>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <png.h>
+#include "linereader.h"
 using namespace std;
 
 #define THROW(a) do{ostringstream _os;\
@@ -35,9 +41,294 @@ struct Data
     {
 	pos_t pos;
 	value_t value;
+	/* the value breaks the ties: the order does not depend on the order of the input */
 	bool operator < (const Data& cp) const
 	    {
-	    return pos < cp.pos;
+	    if(pos!=cp.pos) return pos < cp.pos;
+	    return value < cp.value;
+	    }
+    };
+
+/* q16: -log10(p) from 0 to 655.35 with a precision of 0.01 */
+#define Q16_SCALE 100.0
+/* pixel columns of the deepest level of tiles: one Bucket each per chromosome */
+#define MAX_TILE_COLUMNS (1<<22)
+
+/**
+ * the points of a chromosome: one array for the positions and one for
+ * the values, stored as double, float or quantized on 16 bits.
+ */
+class Points
+    {
+    public:
+	enum Encoding { encode_double, encode_float, encode_q16 };
+    private:
+	Encoding encoding;
+	vector<pos_t> positions;
+	vector<double> doubles;
+	vector<float> floats;
+	vector<uint16_t> quantized;
+
+	/* orders the indexes of the points like Data: on pos, then on value */
+	struct IndexCmp
+	    {
+	    const Points* owner;
+	    bool operator() (uint32_t a,uint32_t b) const
+		{
+		pos_t pa=owner->positions[a];
+		pos_t pb=owner->positions[b];
+		if(pa!=pb) return pa< pb;
+		return owner->value(a)< owner->value(b);
+		}
+	    };
+	template<typename T>
+	static void permute(vector<T>& v,const vector<uint32_t>& order)
+	    {
+	    if(v.empty()) return;
+	    vector<T> sorted(v.size());
+	    for(size_t i=0;i< order.size();++i) sorted[i]=v[order[i]];
+	    v.swap(sorted);
+	    }
+    public:
+	Points(Encoding encoding=encode_double):encoding(encoding)
+	    {
+	    }
+	static bool encodable(Encoding encoding,value_t v)
+	    {
+	    return encoding!=encode_q16 || (v>=0 && v*Q16_SCALE+0.5< 65536);
+	    }
+	size_t size() const
+	    {
+	    return positions.size();
+	    }
+	size_t capacity() const
+	    {
+	    return positions.capacity();
+	    }
+	void reserve(size_t n)
+	    {
+	    positions.reserve(n);
+	    switch(encoding)
+		{
+		case encode_float: floats.reserve(n); break;
+		case encode_q16: quantized.reserve(n); break;
+		default: doubles.reserve(n); break;
+		}
+	    }
+	pos_t pos(size_t i) const
+	    {
+	    return positions[i];
+	    }
+	value_t value(size_t i) const
+	    {
+	    switch(encoding)
+		{
+		case encode_float: return floats[i];
+		case encode_q16: return quantized[i]/Q16_SCALE;
+		default: return doubles[i];
+		}
+	    }
+	Data get(size_t i) const
+	    {
+	    Data d;
+	    d.pos=pos(i);
+	    d.value=value(i);
+	    return d;
+	    }
+	void push_back(const Data& d)
+	    {
+	    positions.push_back(d.pos);
+	    switch(encoding)
+		{
+		case encode_float: floats.push_back((float)d.value); break;
+		case encode_q16: quantized.push_back((uint16_t)(d.value*Q16_SCALE+0.5)); break;
+		default: doubles.push_back(d.value); break;
+		}
+	    }
+	void append(const Points& cp)
+	    {
+	    reserve(size()+cp.size());
+	    for(size_t i=0;i< cp.size();++i) push_back(cp.get(i));
+	    }
+	void sort()
+	    {
+	    vector<uint32_t> order(size());
+	    for(size_t i=0;i< order.size();++i) order[i]=i;
+	    IndexCmp cmp;
+	    cmp.owner=this;
+	    std::sort(order.begin(),order.end(),cmp);
+	    permute(positions,order);
+	    permute(doubles,order);
+	    permute(floats,order);
+	    permute(quantized,order);
+	    }
+    };
+
+/** the points of a range of positions: only the lowest and the highest are kept */
+struct Bucket
+    {
+	/* -1 if empty */
+	pos_t minPos;
+	value_t minValue;
+	pos_t maxPos;
+	value_t maxValue;
+	Bucket():minPos(-1),minValue(0),maxPos(-1),maxValue(0)
+	    {
+	    }
+	bool empty() const
+	    {
+	    return minPos==-1;
+	    }
+	void add(pos_t pos,value_t value)
+	    {
+	    if(empty() || value< minValue)
+		{
+		minPos=pos;
+		minValue=value;
+		}
+	    if(maxPos==-1 || value> maxValue)
+		{
+		maxPos=pos;
+		maxValue=value;
+		}
+	    }
+	void add(const Bucket& cp)
+	    {
+	    if(cp.empty()) return;
+	    add(cp.minPos,cp.minValue);
+	    add(cp.maxPos,cp.maxValue);
+	    }
+    };
+
+/** a pixel column of a binary tile: the lowest and the highest point */
+struct TileColumn
+    {
+    uint16_t column;
+    uint16_t unused;
+    pos_t minPos;
+    float minValue;
+    pos_t maxPos;
+    float maxValue;
+    };
+
+/** RGB image in memory, the points are splatted with an alpha */
+class FrameBuffer
+    {
+    public:
+	int width;
+	int height;
+	vector<unsigned char> pixels;
+	FrameBuffer(int width,int height):width(width),height(height),pixels((size_t)width*height*3,255)
+	    {
+	    }
+	void blend(int x,int y,unsigned char r,unsigned char g,unsigned char b,float alpha)
+	    {
+	    if(x<0 || y<0 || x>=width || y>=height) return;
+	    unsigned char* p=&pixels[((size_t)y*width+x)*3];
+	    p[0]=(unsigned char)(p[0]+(r-p[0])*alpha);
+	    p[1]=(unsigned char)(p[1]+(g-p[1])*alpha);
+	    p[2]=(unsigned char)(p[2]+(b-p[2])*alpha);
+	    }
+	/** blends 'count' times, stops as soon as the pixel does not change anymore */
+	void blend(int x,int y,unsigned char r,unsigned char g,unsigned char b,float alpha,uint32_t count)
+	    {
+	    if(x<0 || y<0 || x>=width || y>=height) return;
+	    unsigned char* p=&pixels[((size_t)y*width+x)*3];
+	    for(uint32_t i=0;i< count;++i)
+		{
+		unsigned char p0=p[0],p1=p[1],p2=p[2];
+		blend(x,y,r,g,b,alpha);
+		if(p0==p[0] && p1==p[1] && p2==p[2]) break;
+		}
+	    }
+	/**
+	 * same as a diamond at each pixel of 'centers' (one counter per pixel of
+	 * the image) but each pixel is blended once per diamond covering it: the
+	 * blends of a single color do not depend on their order.
+	 */
+	void diamonds(const vector<uint32_t>& centers,int radius,unsigned char r,unsigned char g,unsigned char b,float alpha)
+	    {
+	    vector<uint32_t> cover(centers.size(),0);
+	    for(int y=0;y< height;++y)
+		{
+		for(int x=0;x< width;++x)
+		    {
+		    uint32_t n=centers[(size_t)y*width+x];
+		    if(n==0) continue;
+		    for(int dy=max(-radius,-y);dy<=radius && y+dy< height;++dy)
+			{
+			int half=radius-abs(dy);
+			for(int dx=max(-half,-x);dx<=half && x+dx< width;++dx)
+			    {
+			    cover[(size_t)(y+dy)*width+x+dx]+=n;
+			    }
+			}
+		    }
+		}
+	    for(int y=0;y< height;++y)
+		{
+		for(int x=0;x< width;++x)
+		    {
+		    uint32_t n=cover[(size_t)y*width+x];
+		    if(n>0) blend(x,y,r,g,b,alpha,n);
+		    }
+		}
+	    }
+	void hline(int x1,int x2,int y,unsigned char gray)
+	    {
+	    for(int x=x1;x<=x2;++x) blend(x,y,gray,gray,gray,1.0f);
+	    }
+	void vline(int x,int y1,int y2,unsigned char gray)
+	    {
+	    for(int y=y1;y<=y2;++y) blend(x,y,gray,gray,gray,1.0f);
+	    }
+	void box(int x,int y,int w,int h,unsigned char gray)
+	    {
+	    hline(x,x+w,y,gray);
+	    hline(x,x+w,y+h,gray);
+	    vline(x,y,y+h,gray);
+	    vline(x+w,y,y+h,gray);
+	    }
+	/** same diamond as the postscript procedure 'diams' */
+	void diamond(int cx,int cy,int radius,unsigned char r,unsigned char g,unsigned char b,float alpha)
+	    {
+	    for(int dy=-radius;dy<=radius;++dy)
+		{
+		int half=radius-abs(dy);
+		for(int dx=-half;dx<=half;++dx)
+		    {
+		    blend(cx+dx,cy+dy,r,g,b,alpha);
+		    }
+		}
+	    }
+	static void pngWrite(png_structp png,png_bytep data,png_size_t length)
+	    {
+	    ((ostream*)png_get_io_ptr(png))->write((const char*)data,length);
+	    }
+	static void pngFlush(png_structp png)
+	    {
+	    ((ostream*)png_get_io_ptr(png))->flush();
+	    }
+	void writePNG(ostream& out)
+	    {
+	    png_structp png=png_create_write_struct(PNG_LIBPNG_VER_STRING,NULL,NULL,NULL);
+	    if(png==NULL) THROW("Cannot create PNG");
+	    png_infop info=png_create_info_struct(png);
+	    if(info==NULL || setjmp(png_jmpbuf(png)))
+		{
+		png_destroy_write_struct(&png,&info);
+		THROW("Cannot write PNG");
+		}
+	    png_set_write_fn(png,&out,FrameBuffer::pngWrite,FrameBuffer::pngFlush);
+	    png_set_IHDR(png,info,width,height,8,PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE,PNG_COMPRESSION_TYPE_DEFAULT,PNG_FILTER_TYPE_DEFAULT);
+	    png_write_info(png,info);
+	    for(int y=0;y< height;++y)
+		{
+		png_write_row(png,(png_bytep)&pixels[(size_t)y*width*3]);
+		}
+	    png_write_end(png,info);
+	    png_destroy_write_struct(&png,&info);
 	    }
     };
 
@@ -74,18 +365,6 @@ struct smart_cmp
 
 class Manhattan
     {
-    private:
-	bool readline(gzFile in,std::string& line)
-	    {
-	    line.clear();
-	    int c;
-	    if(gzeof(in)) return false;
-	    while((c=gzgetc(in))!=EOF && c!='\n')
-		{
-		line+=(char)c;
-		}
-	    return true;
-	    }
     public:
 
 	class ChromInfo
@@ -101,7 +380,54 @@ class Manhattan
 		    {
 		    return chromEnd-chromStart;
 		    }
-		vector<Data> data;
+		/* all the points or, when binning, the outliers */
+		Points data;
+		/* binning: buckets[i] holds the positions [(first_bucket+i)*resolution,(first_bucket+i+1)*resolution[ */
+		pos_t resolution;
+		size_t first_bucket;
+		vector<Bucket> buckets;
+		ChromInfo(Points::Encoding encoding):chromStart(INT_MAX),chromEnd(0),x(0),width(0),index_data(0),data(encoding),resolution(1),first_bucket(0)
+		    {
+		    }
+		/**
+		 * adds a point to its bucket, doubling the resolution while the
+		 * range chromStart-chromEnd (updated by the caller) needs more than
+		 * max_buckets: the resolution depends on the span of the data, not
+		 * on its distance from 0. The buckets are aligned on multiples of
+		 * the resolution, whatever the order of the points.
+		 */
+		void bin(const Data& d,size_t max_buckets)
+		    {
+		    while((size_t)(chromEnd/resolution-chromStart/resolution)>=max_buckets)
+			{
+			resolution*=2;
+			size_t first=first_bucket/2;
+			for(size_t i=0;i< buckets.size();++i)
+			    {
+			    size_t j=(first_bucket+i)/2-first;
+			    if(j==i) continue;
+			    buckets[j].add(buckets[i]);
+			    buckets[i]=Bucket();
+			    }
+			if(!buckets.empty()) buckets.resize((first_bucket+buckets.size()-1)/2-first+1);
+			first_bucket=first;
+			}
+		    size_t g=d.pos/resolution;
+		    if(buckets.empty())
+			{
+			first_bucket=g;
+			}
+		    else if(g< first_bucket)
+			{
+			/* rebased: room is left before the new first bucket, a decreasing input does not move the buckets each time */
+			size_t last=first_bucket+buckets.size()-1;
+			size_t room=min((size_t)g,min(buckets.size(),max_buckets-(last-g+1)));
+			buckets.insert(buckets.begin(),first_bucket-(g-room),Bucket());
+			first_bucket=g-room;
+			}
+		    if(g-first_bucket>=buckets.size()) buckets.resize(g-first_bucket+1);
+		    buckets[g-first_bucket].add(d.pos,d.value);
+		    }
 	    };
 	typedef std::map<string,ChromInfo*,smart_cmp> chrom2info_t;
 	char delim;
@@ -115,6 +441,26 @@ class Manhattan
 	pixel_t margin_right;
 	pixel_t margin_top;
 	pixel_t margin_bottom;
+	/* aggregate the points in buckets instead of keeping them all */
+	bool binning;
+	/* binning: the points with a value >= threshold are all kept */
+	value_t threshold;
+	enum { format_ps, format_svg, format_png } format;
+	/* threads inflating a BGZF input, parsing the lines and sorting the chromosomes */
+	int nthreads;
+	/* storage of the values */
+	Points::Encoding encoding;
+	/* tile pyramid: output directory, number of zoom levels, width and height of a tile */
+	const char* tile_dir;
+	int zoom_levels;
+	int tile_size;
+	/* size of a plain input file, used to guess the number of points still to read */
+	size_t input_size;
+	size_t points_left;
+	/* last chromosome found by add() */
+	ChromInfo* last;
+	vector<Field> tokens;
+	string chromName;
 	Manhattan():delim('\t'),
 		chrom2info(),
 		output(&cout),
@@ -127,6 +473,17 @@ class Manhattan
 	    margin_bottom=100;
 	    margin_top=100;
 	    margin_right=100;
+	    binning=false;
+	    threshold=DBL_MAX;
+	    format=format_ps;
+	    nthreads=1;
+	    encoding=Points::encode_double;
+	    tile_dir=NULL;
+	    zoom_levels=6;
+	    tile_size=256;
+	    input_size=0;
+	    points_left=0;
+	    last=NULL;
 	    }
 
 	~Manhattan()
@@ -140,53 +497,360 @@ class Manhattan
 	    }
 
 
-	void readData(gzFile in)
+	/** parses one line */
+	void add(const Field& line)
 	    {
-	    string line;
-	    while(readline(in,line))
-		{
-
-		if(line.empty() || line[0]=='#') continue;
-		string::size_type n1=line.find(delim);
-		if(n1==string::npos) THROW("delimiter 'chrom' missing in "<< line);
-		string str=line.substr(0,n1);
+	    if(line.length==0 || line.begin[0]=='#') return;
+	    LineReader::split(line,delim,tokens);
+	    if(tokens.size()<2) THROW("delimiter 'chrom' missing in "<< line.str());
 
-		ChromInfo* chromInfo;
-		chrom2info_t::iterator r= chrom2info.find(str);
+	    /* the lines are usually grouped by chromosome */
+	    ChromInfo* chromInfo=last;
+	    if(chromInfo==NULL || !tokens[0].equals(chromInfo->chrom))
+		{
+		chromName.assign(tokens[0].begin,tokens[0].length);
+		chrom2info_t::iterator r= chrom2info.find(chromName);
 		if(r==chrom2info.end())
 		    {
-		    chromInfo=new ChromInfo;
-		    chromInfo->chrom=str;
-		    chrom2info.insert(make_pair<string,ChromInfo*>(str,chromInfo));
+		    chromInfo=new ChromInfo(encoding);
+		    chromInfo->chrom=chromName;
+		    chrom2info.insert(make_pair(chromName,chromInfo));
 		    }
 		else
 		    {
 		    chromInfo=r->second;
 		    }
-		string::size_type n2=line.find(delim,++n1);
-		if(n2==string::npos) THROW("delimiter 'pos' missing in "<< line);
-		str=line.substr(n1,n2-n1);
-
-		char* p2;
-		Data newdata;
-		newdata.pos= strtol(str.c_str(),&p2,10);
-		if(!(*p2==0) || newdata.pos<0)
+		last=chromInfo;
+		}
+	    if(tokens.size()<3) THROW("delimiter 'pos' missing in "<< line.str());
+
+	    long pos;
+	    Data newdata;
+	    if(!LineReader::toLong(tokens[1],&pos) || pos<0 || pos>INT_MAX)
+		{
+		THROW("Bad position in "<< line.str());
+		}
+	    newdata.pos=(pos_t)pos;
+	    chromInfo->chromStart=min(chromInfo->chromStart,newdata.pos);
+	    chromInfo->chromEnd=max(chromInfo->chromEnd,newdata.pos);
+	    if(!LineReader::toDouble(tokens[2],&newdata.value) || isnan(newdata.value))
+		{
+		THROW("Bad value in "<< line.str());
+		}
+	    if(!Points::encodable(encoding,newdata.value))
+		{
+		THROW("Value out of range for q16 in "<< line.str());
+		}
+	    if(!binning || newdata.value>=threshold)
+		{
+		Points& data=chromInfo->data;
+		/* no need to double the arrays beyond the number of points still in the input */
+		if(points_left>0 && data.size()==data.capacity())
+		    {
+		    data.reserve(data.size()+max((size_t)1,min(max(data.size(),(size_t)16),points_left)));
+		    }
+		data.push_back(newdata);
+		}
+	    else
+		{
+		/* a chromosome is never wider than the x axis (or the deepest level of tiles): at least one bucket per pixel */
+		chromInfo->bin(newdata,maxBuckets());
+		}
+	    minValue=min(minValue,newdata.value);
+	    maxValue=max(maxValue,newdata.value);
+	    }
+
+	/** parses the lines of a block, each one ends with '\n' */
+	void add(const string& block)
+	    {
+	    const char* p=block.data();
+	    const char* stop=p+block.size();
+	    while(p< stop)
+		{
+		const char* q=(const char*)memchr(p,'\n',stop-p);
+		if(q==NULL) q=stop;
+		Field line;
+		line.begin=p;
+		line.length=q-p;
+		add(line);
+		p=q+1;
+		}
+	    }
+
+	/** moves the points of 'other' to this one */
+	void merge(Manhattan& other)
+	    {
+	    for(chrom2info_t::iterator r=other.chrom2info.begin();
+		    r!=other.chrom2info.end();
+		    ++r)
+		{
+		ChromInfo* src=r->second;
+		ChromInfo* c;
+		chrom2info_t::iterator r2=chrom2info.find(r->first);
+		if(r2==chrom2info.end())
+		    {
+		    c=new ChromInfo(encoding);
+		    c->chrom=src->chrom;
+		    chrom2info.insert(make_pair(c->chrom,c));
+		    }
+		else
+		    {
+		    c=r2->second;
+		    }
+		c->chromStart=min(c->chromStart,src->chromStart);
+		c->chromEnd=max(c->chromEnd,src->chromEnd);
+		c->data.append(src->data);
+		for(size_t i=0;i< src->buckets.size();++i)
+		    {
+		    const Bucket& b=src->buckets[i];
+		    if(b.empty()) continue;
+		    Data d;
+		    d.pos=b.minPos;
+		    d.value=b.minValue;
+		    c->bin(d,maxBuckets());
+		    d.pos=b.maxPos;
+		    d.value=b.maxValue;
+		    c->bin(d,maxBuckets());
+		    }
+		}
+	    minValue=min(minValue,other.minValue);
+	    maxValue=max(maxValue,other.maxValue);
+	    }
+
+	/** blocks of lines parsed by 'nthreads' Manhattan */
+	struct ParseQueue
+	    {
+	    Manhattan* owner;
+	    vector<Manhattan*> parsers;
+	    vector<pthread_t> threads;
+	    deque<string*> todo;
+	    vector<string*> spare;
+	    pthread_mutex_t mutex;
+	    pthread_cond_t cond_todo;
+	    pthread_cond_t cond_space;
+	    bool finished;
+	    string error;
+	    };
+	struct Parser
+	    {
+	    ParseQueue* queue;
+	    Manhattan* data;
+	    };
+
+	static void* parse(void* arg)
+	    {
+	    Parser* p=(Parser*)arg;
+	    ParseQueue* q=p->queue;
+	    for(;;)
+		{
+		::pthread_mutex_lock(&q->mutex);
+		while(!q->finished && q->todo.empty())
+		    {
+		    ::pthread_cond_wait(&q->cond_todo,&q->mutex);
+		    }
+		if(q->todo.empty())
+		    {
+		    ::pthread_mutex_unlock(&q->mutex);
+		    break;
+		    }
+		string* block=q->todo.front();
+		q->todo.pop_front();
+		::pthread_cond_signal(&q->cond_space);
+		::pthread_mutex_unlock(&q->mutex);
+		try
+		    {
+		    p->data->add(*block);
+		    }
+		catch(std::exception& err)
+		    {
+		    ::pthread_mutex_lock(&q->mutex);
+		    if(q->error.empty()) q->error.assign(err.what());
+		    ::pthread_mutex_unlock(&q->mutex);
+		    }
+		::pthread_mutex_lock(&q->mutex);
+		q->spare.push_back(block);
+		::pthread_mutex_unlock(&q->mutex);
+		}
+	    return NULL;
+	    }
+
+	void readData(BgzfReader& in)
+	    {
+	    LineReader reader(in);
+	    if(nthreads<=1)
+		{
+		Field line;
+		size_t nLines=0;
+		size_t bytes=0;
+		while(reader.next(line))
+		    {
+		    ++nLines;
+		    bytes+=line.length+1;
+		    /* guess the number of lines still to read from their mean length */
+		    if(input_size>bytes && nLines%4096==0)
+			{
+			points_left=(size_t)((input_size-bytes)/((double)bytes/nLines))+1;
+			}
+		    add(line);
+		    }
+		points_left=0;
+		return;
+		}
+	    /* each thread parses blocks of lines into its own Manhattan, merged at the end */
+	    ParseQueue q;
+	    vector<Parser> parsers(nthreads);
+	    q.finished=false;
+	    ::pthread_mutex_init(&q.mutex,NULL);
+	    ::pthread_cond_init(&q.cond_todo,NULL);
+	    ::pthread_cond_init(&q.cond_space,NULL);
+	    q.threads.resize(nthreads);
+	    for(int i=0;i< nthreads;++i)
+		{
+		Manhattan* m=new Manhattan;
+		m->delim=delim;
+		m->binning=binning;
+		m->threshold=threshold;
+		m->x_axis_width=x_axis_width;
+		m->encoding=encoding;
+		m->tile_dir=tile_dir;
+		m->zoom_levels=zoom_levels;
+		m->tile_size=tile_size;
+		parsers[i].queue=&q;
+		parsers[i].data=m;
+		if(::pthread_create(&q.threads[i],NULL,Manhattan::parse,&parsers[i])!=0)
+		    {
+		    THROW("cannot create thread "<< i);
+		    }
+		}
+	    for(;;)
+		{
+		string* block=NULL;
+		::pthread_mutex_lock(&q.mutex);
+		if(!q.spare.empty())
+		    {
+		    block=q.spare.back();
+		    q.spare.pop_back();
+		    }
+		::pthread_mutex_unlock(&q.mutex);
+		if(block==NULL) block=new string;
+		block->clear();
+		if(!reader.next(*block,4*1048576))
 		    {
-		    THROW("Bad position in "<< line);
+		    delete block;
+		    break;
 		    }
-		chromInfo->chromStart=min(chromInfo->chromStart,newdata.pos);
-		chromInfo->chromEnd=max(chromInfo->chromEnd,newdata.pos);
-		string::size_type n3=line.find(delim,++n2);
-		str=line.substr(n2,n3==string::npos?line.size()-n2:n3-n2);
-		newdata.value= strtod(str.c_str(),&p2);
-		if(!(*p2==0) || isnan(newdata.value))
+		::pthread_mutex_lock(&q.mutex);
+		while(q.todo.size()>=2*(size_t)nthreads)
 		    {
-		    THROW("Bad value in "<< line);
+		    ::pthread_cond_wait(&q.cond_space,&q.mutex);
 		    }
-		chromInfo->data.push_back(newdata);
-		minValue=min(minValue,newdata.value);
-		maxValue=max(maxValue,newdata.value);
+		q.todo.push_back(block);
+		::pthread_cond_signal(&q.cond_todo);
+		::pthread_mutex_unlock(&q.mutex);
+		}
+	    ::pthread_mutex_lock(&q.mutex);
+	    q.finished=true;
+	    ::pthread_cond_broadcast(&q.cond_todo);
+	    ::pthread_mutex_unlock(&q.mutex);
+	    for(int i=0;i< nthreads;++i)
+		{
+		::pthread_join(q.threads[i],NULL);
+		merge(*parsers[i].data);
+		delete parsers[i].data;
 		}
+	    for(size_t i=0;i< q.spare.size();++i) delete q.spare[i];
+	    ::pthread_cond_destroy(&q.cond_space);
+	    ::pthread_cond_destroy(&q.cond_todo);
+	    ::pthread_mutex_destroy(&q.mutex);
+	    if(!q.error.empty()) throw runtime_error(q.error);
+	    }
+
+	/** the chromosomes sorted by 'nthreads' threads */
+	struct SortQueue
+	    {
+	    vector<ChromInfo*> chroms;
+	    size_t next;
+	    pthread_mutex_t mutex;
+	    };
+	static void* sortChroms(void* arg)
+	    {
+	    SortQueue* q=(SortQueue*)arg;
+	    for(;;)
+		{
+		ChromInfo* c=NULL;
+		::pthread_mutex_lock(&q->mutex);
+		if(q->next< q->chroms.size()) c=q->chroms[q->next++];
+		::pthread_mutex_unlock(&q->mutex);
+		if(c==NULL) break;
+		c->data.sort();
+		}
+	    return NULL;
+	    }
+	void sortData()
+	    {
+	    SortQueue q;
+	    q.next=0;
+	    /* largest first */
+	    vector<pair<size_t,ChromInfo*> > sizes;
+	    for(chrom2info_t::iterator r=chrom2info.begin();r!=chrom2info.end();++r)
+		{
+		sizes.push_back(make_pair(r->second->data.size(),r->second));
+		}
+	    std::sort(sizes.rbegin(),sizes.rend());
+	    for(size_t i=0;i< sizes.size();++i) q.chroms.push_back(sizes[i].second);
+	    ::pthread_mutex_init(&q.mutex,NULL);
+	    vector<pthread_t> threads(max(0,min(nthreads,(int)q.chroms.size())-1));
+	    for(size_t i=0;i< threads.size();++i)
+		{
+		if(::pthread_create(&threads[i],NULL,Manhattan::sortChroms,&q)!=0)
+		    {
+		    THROW("cannot create thread "<< i);
+		    }
+		}
+	    Manhattan::sortChroms(&q);
+	    for(size_t i=0;i< threads.size();++i) ::pthread_join(threads[i],NULL);
+	    ::pthread_mutex_destroy(&q.mutex);
+	    }
+
+	/**
+	 * binning: the buckets are merged by pixel column, the lowest and the
+	 * highest point of each column are added to the outliers
+	 */
+	void collapse(ChromInfo* c)
+	    {
+	    vector<Bucket> columns((size_t)c->width+1);
+	    for(size_t i=0;i< c->buckets.size();++i)
+		{
+		const Bucket& b=c->buckets[i];
+		if(b.empty()) continue;
+		columns[column(c,b.minPos)].add(b.minPos,b.minValue);
+		columns[column(c,b.maxPos)].add(b.maxPos,b.maxValue);
+		}
+	    c->buckets.clear();
+	    for(size_t i=0;i< columns.size();++i)
+		{
+		const Bucket& b=columns[i];
+		if(b.empty()) continue;
+		Data d;
+		d.pos=b.minPos;
+		d.value=b.minValue;
+		c->data.push_back(d);
+		if(b.maxPos==b.minPos) continue;
+		d.pos=b.maxPos;
+		d.value=b.maxValue;
+		c->data.push_back(d);
+		}
+	    }
+	size_t maxBuckets() const
+	    {
+	    if(tile_dir!=NULL) return (size_t)tile_size<<zoom_levels;
+	    return 2*(size_t)x_axis_width;
+	    }
+	size_t column(const ChromInfo* c,pos_t pos)
+	    {
+	    double x=((pos-c->chromStart)/(double)(c->chromEnd-c->chromStart))*c->width;
+	    if(x<0) return 0;
+	    return min((size_t)x,(size_t)c->width);
 	    }
 	pixel_t pageWidth()
 	    {
@@ -196,9 +860,20 @@ class Manhattan
 	    {
 	    return (margin_top+margin_bottom+y_axis_height);
 	    }
-	void print()
+	/** x of a position in the layout, same as 'convertPos2X' in the postscript */
+	pixel_t convertPos2X(const ChromInfo* c,pos_t pos)
+	    {
+	    return ((pos-c->chromStart)/(double)(c->chromEnd-c->chromStart))*c->width+c->x;
+	    }
+	/** y of a value from the bottom of the page, same as 'convertValue2Y' in the postscript */
+	pixel_t convertValue2Y(value_t v)
+	    {
+	    return ((v-minValue)/(maxValue-minValue))*y_axis_height+margin_bottom;
+	    }
+
+	/** margins of the values and of the positions of each chromosome */
+	void margins()
 	    {
-	    int64_t size_of_genome=0L;
 	    if(fabs(minValue-maxValue) < 10* DBL_EPSILON)
 		{
 		minValue-=1;
@@ -217,10 +892,19 @@ class Manhattan
 		double length5=1+(c->length()/100.0)*5.0;
 		c->chromStart=max(0,(pos_t)(c->chromStart-length5));
 		c->chromEnd=c->chromEnd+length5;
+		}
+	    }
 
-		std::sort(c->data.begin(),c->data.end());
-
-		size_of_genome+=c->length();
+	/** margins, x and width of each chromosome */
+	void layout()
+	    {
+	    int64_t size_of_genome=0L;
+	    margins();
+	    for(chrom2info_t::iterator r=chrom2info.begin();
+		    r!=chrom2info.end();
+		    ++r)
+		{
+		size_of_genome+=r->second->length();
 		assert(size_of_genome>0);
 		}
 	    pixel_t x=margin_left;
@@ -236,8 +920,12 @@ class Manhattan
 		assert(x_axis_width>0);
 		assert(c->width>0);
 		x+=c->width;
+		if(binning) collapse(c);
 		}
+	    }
 
+	void printPostscript()
+	    {
 	    ostream& out=(*output);
 	    time_t rawtime;
 	    time ( &rawtime );
@@ -347,11 +1035,10 @@ class Manhattan
 		    {
 		    r->second->index_data=index_data;
 		    out << "% "<< r->second->chrom<< " 2x(" << r->second->index_data << ")\n";
-		    for(vector<Data>::iterator r2=r->second->data.begin();
-			    r2!=r->second->data.end();
-			    ++r2)
+		    const Points& data=r->second->data;
+		    for(size_t i=0;i< data.size();++i)
 			    {
-			    out << r2->pos  << " " << r2->value << "\n";
+			    out << data.pos(i)  << " " << data.value(i) << "\n";
 			    index_data++;
 			    }
 		    }
@@ -384,6 +1071,215 @@ class Manhattan
 	    out.flush();
 	    }
 
+	void printSVG()
+	    {
+	    ostream& out=(*output);
+	    pixel_t H=pageHeight();
+	    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << pageWidth()
+		<< "\" height=\"" << H << "\" font-family=\"Courier\" font-size=\"14\">\n"
+		"<title>" << __FILE__ << "</title>\n"
+		"<rect x=\"0\" y=\"0\" width=\"" << pageWidth() << "\" height=\"" << H
+		<< "\" fill=\"white\" stroke=\"black\"/>\n";
+	    for(int i=0;i< 10;++i)
+		{
+		pixel_t y=H-(i/10.0*y_axis_height+margin_bottom);
+		out << "<line x1=\"" << margin_left << "\" y1=\"" << y << "\" x2=\"" << (margin_left-10)
+		    << "\" y2=\"" << y << "\" stroke=\"black\"/>"
+		    "<text x=\"1\" y=\"" << (y-(y_axis_height/10.0)) << "\">"
+		    << ((i+1)/10.0*(maxValue-minValue)+minValue) << "</text>\n";
+		}
+	    for(chrom2info_t::iterator r=chrom2info.begin();
+		    r!=chrom2info.end();
+		    ++r)
+		{
+		ChromInfo* c=r->second;
+		out << "<g><rect x=\"" << c->x << "\" y=\"" << margin_top << "\" width=\"" << c->width
+		    << "\" height=\"" << y_axis_height << "\" fill=\"none\" stroke=\"lightgray\"/>"
+		    "<text transform=\"translate(" << (c->x+c->width*0.5) << "," << margin_top
+		    << ") rotate(-90)\">" << c->chrom << "</text>\n";
+		/* all the diamonds of the chromosome in one path */
+		out << "<path fill=\"blue\" d=\"";
+		for(size_t i=0;i< c->data.size();++i)
+		    {
+		    out << "M" << convertPos2X(c,c->data.pos(i)) << "," << (H-convertValue2Y(c->data.value(i))-5)
+			<< "l5,5l-5,5l-5,-5z";
+		    }
+		out << "\"/></g>\n";
+		}
+	    out << "</svg>\n";
+	    out.flush();
+	    }
+
+	/** the points are counted by pixel then splatted in a FrameBuffer, there is no text */
+	void printPNG()
+	    {
+	    pixel_t H=pageHeight();
+	    FrameBuffer img((int)pageWidth(),(int)H);
+	    vector<uint32_t> hits((size_t)img.width*img.height,0);
+	    for(chrom2info_t::iterator r=chrom2info.begin();
+		    r!=chrom2info.end();
+		    ++r)
+		{
+		ChromInfo* c=r->second;
+		img.box((int)c->x,(int)margin_top,(int)c->width,(int)y_axis_height,204);
+		}
+	    for(int i=0;i< 10;++i)
+		{
+		int y=(int)(H-(i/10.0*y_axis_height+margin_bottom));
+		img.hline((int)margin_left-10,(int)margin_left,y,0);
+		}
+	    for(chrom2info_t::iterator r=chrom2info.begin();
+		    r!=chrom2info.end();
+		    ++r)
+		{
+		ChromInfo* c=r->second;
+		for(size_t i=0;i< c->data.size();++i)
+		    {
+		    int x=(int)convertPos2X(c,c->data.pos(i));
+		    int y=(int)(H-convertValue2Y(c->data.value(i)));
+		    if(x<0 || y<0 || x>=img.width || y>=img.height)
+			{
+			img.diamond(x,y,5,0,0,255,0.5f);
+			continue;
+			}
+		    ++hits[(size_t)y*img.width+x];
+		    }
+		}
+	    img.diamonds(hits,5,0,0,255,0.5f);
+	    img.box(0,0,img.width-1,img.height-1,0);
+	    img.writePNG(*output);
+	    output->flush();
+	    }
+
+	static void makeDir(const string& path)
+	    {
+	    if(::mkdir(path.c_str(),0755)!=0 && errno!=EEXIST)
+		{
+		THROW("Cannot create directory "<< path << " " << strerror(errno));
+		}
+	    }
+
+	/** writes the tile 'x' of a level, nothing if the tile is empty */
+	void writeTile(const string& levelDir,size_t x,const Bucket* columns)
+	    {
+	    vector<TileColumn> nonEmpty;
+	    for(int i=0;i< tile_size;++i)
+		{
+		const Bucket& b=columns[i];
+		if(b.empty()) continue;
+		TileColumn t;
+		t.column=(uint16_t)i;
+		t.unused=0;
+		t.minPos=b.minPos;
+		t.minValue=(float)b.minValue;
+		t.maxPos=b.maxPos;
+		t.maxValue=(float)b.maxValue;
+		nonEmpty.push_back(t);
+		}
+	    if(nonEmpty.empty()) return;
+	    ostringstream filename;
+	    filename << levelDir << "/" << x << (format==format_png?".png":".bin");
+	    ofstream out(filename.str().c_str(),ios::out|ios::binary);
+	    if(!out.is_open()) THROW("Cannot open "<< filename.str());
+	    if(format==format_png)
+		{
+		FrameBuffer img(tile_size,tile_size);
+		for(size_t i=0;i< nonEmpty.size();++i)
+		    {
+		    const TileColumn& t=nonEmpty[i];
+		    img.diamond(t.column,(int)((1.0-(t.minValue-minValue)/(maxValue-minValue))*(tile_size-1)),2,0,0,255,0.5f);
+		    if(t.maxPos==t.minPos) continue;
+		    img.diamond(t.column,(int)((1.0-(t.maxValue-minValue)/(maxValue-minValue))*(tile_size-1)),2,0,0,255,0.5f);
+		    }
+		img.writePNG(out);
+		}
+	    else
+		{
+		out.write((const char*)&nonEmpty[0],nonEmpty.size()*sizeof(TileColumn));
+		}
+	    out.close();
+	    if(!out) THROW("Cannot write "<< filename.str());
+	    }
+
+	/**
+	 * tile pyramid: the level z of a chromosome has 2^z tiles of tile_size
+	 * pixel columns. Each column keeps its lowest and its highest point,
+	 * a level is built from the next one by merging the columns by pairs.
+	 * Layout: DIR/index.tsv, DIR/chrom/z/x.(png|bin), the empty tiles are
+	 * not written.
+	 */
+	void printTiles()
+	    {
+	    margins();
+	    string dir(tile_dir);
+	    makeDir(dir);
+	    string filename=dir+"/index.tsv";
+	    ofstream index(filename.c_str());
+	    if(!index.is_open()) THROW("Cannot open "<< filename);
+	    index << "#format\t" << (format==format_png?"png":"bin") << "\n"
+		<< "#tile_size\t" << tile_size << "\n"
+		<< "#minValue\t" << minValue << "\n"
+		<< "#maxValue\t" << maxValue << "\n"
+		<< "#chrom\tchromStart\tchromEnd\tlevels\n";
+	    size_t ncols=maxBuckets();
+	    for(chrom2info_t::iterator r=chrom2info.begin();
+		    r!=chrom2info.end();
+		    ++r)
+		{
+		ChromInfo* c=r->second;
+		index << c->chrom << "\t" << c->chromStart << "\t" << c->chromEnd << "\t" << (zoom_levels+1) << "\n";
+		double scale=ncols/(double)c->length();
+		vector<Bucket> columns(ncols);
+		for(size_t i=0;i< c->data.size();++i)
+		    {
+		    pos_t pos=c->data.pos(i);
+		    columns[min(ncols-1,(size_t)((pos-c->chromStart)*scale))].add(pos,c->data.value(i));
+		    }
+		for(size_t i=0;i< c->buckets.size();++i)
+		    {
+		    const Bucket& b=c->buckets[i];
+		    if(b.empty()) continue;
+		    columns[min(ncols-1,(size_t)((b.minPos-c->chromStart)*scale))].add(b.minPos,b.minValue);
+		    columns[min(ncols-1,(size_t)((b.maxPos-c->chromStart)*scale))].add(b.maxPos,b.maxValue);
+		    }
+		string chromDir=dir+"/"+c->chrom;
+		makeDir(chromDir);
+		for(int z=zoom_levels;z>=0;--z)
+		    {
+		    ostringstream levelDir;
+		    levelDir << chromDir << "/" << z;
+		    makeDir(levelDir.str());
+		    for(size_t x=0;x*tile_size< columns.size();++x)
+			{
+			writeTile(levelDir.str(),x,&columns[x*tile_size]);
+			}
+		    for(size_t i=0;i< columns.size()/2;++i)
+			{
+			Bucket b=columns[2*i];
+			b.add(columns[2*i+1]);
+			columns[i]=b;
+			}
+		    columns.resize(columns.size()/2);
+		    }
+		}
+	    index.close();
+	    if(!index) THROW("Cannot write "<< filename);
+	    }
+
+	void print()
+	    {
+	    layout();
+	    /* only the postscript needs the points in order: its /expData array is part of the output */
+	    if(format==format_ps) sortData();
+	    switch(format)
+		{
+		case format_svg: printSVG(); break;
+		case format_png: printPNG(); break;
+		default: printPostscript(); break;
+		}
+	    }
+
     };
 
 int main(int argc,char** argv)
@@ -396,8 +1292,96 @@ int main(int argc,char** argv)
    			{
    			cerr << argv[0] << "Pierre Lindenbaum PHD. 2011.\n";
    			cerr << "Compilation: "<<__DATE__<<"  at "<< __TIME__<<".\n";
+   			cerr << "Options:\n";
+   			cerr << "  --bin aggregate the points: only the lowest and the highest point of each\n"
+   				"     pixel column are plotted. Memory and output are bounded by the width of the plot.\n";
+   			cerr << "  --threshold (float) with --bin: the points with a value >= threshold are all plotted.\n";
+   			cerr << "  --format (ps|svg|png) output format (default ps). The PNG has no text.\n";
+   			cerr << "  --threads (int) number of threads inflating a BGZF input, parsing the lines\n"
+   				"     and sorting the chromosomes for the postscript (default 1).\n";
+   			cerr << "  --values (double|float|q16) storage of the values in memory (default double).\n"
+   				"     q16: the values are -log10(p) from 0 to 655.35, stored with a precision of 0.01.\n";
+   			cerr << "  --tiles (dir) instead of a plot, writes a pyramid of tiles for a viewer: dir/index.tsv and\n"
+   				"     dir/chrom/zoom/x.(png|bin). The tiles are PNG with --format png, else binary: one\n"
+   				"     record {uint16 column,uint16 unused,int32 minPos,float minValue,int32 maxPos,float maxValue}\n"
+   				"     (native byte order) for each non-empty pixel column.\n";
+   			cerr << "  --zoom (int) with --tiles: zoom levels below the whole chromosome (default 6).\n";
+   			cerr << "  --tile-size (int) with --tiles: width and height of a tile (default 256).\n"
+   				"     tile-size*2^zoom must not exceed " << MAX_TILE_COLUMNS << ".\n";
    			exit(EXIT_FAILURE);
    			}
+   		else if(std::strcmp(argv[optind],"--format")==0 && optind+1<argc)
+   			{
+   			char* f=argv[++optind];
+   			if(std::strcmp(f,"ps")==0) app.format=Manhattan::format_ps;
+   			else if(std::strcmp(f,"svg")==0) app.format=Manhattan::format_svg;
+   			else if(std::strcmp(f,"png")==0) app.format=Manhattan::format_png;
+   			else
+   			    {
+   			    cerr << "Bad format "<< f << "\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--threads")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			app.nthreads=(int)strtol(argv[++optind],&p2,10);
+   			if(app.nthreads<1 || *p2!=0)
+   			    {
+   			    cerr << "Bad number of threads\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--values")==0 && optind+1<argc)
+   			{
+   			char* f=argv[++optind];
+   			if(std::strcmp(f,"double")==0) app.encoding=Points::encode_double;
+   			else if(std::strcmp(f,"float")==0) app.encoding=Points::encode_float;
+   			else if(std::strcmp(f,"q16")==0) app.encoding=Points::encode_q16;
+   			else
+   			    {
+   			    cerr << "Bad encoding "<< f << "\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--tiles")==0 && optind+1<argc)
+   			{
+   			app.tile_dir=argv[++optind];
+   			}
+   		else if(std::strcmp(argv[optind],"--zoom")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			app.zoom_levels=(int)strtol(argv[++optind],&p2,10);
+   			if(app.zoom_levels<0 || app.zoom_levels>16 || *p2!=0)
+   			    {
+   			    cerr << "Bad number of zoom levels\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--tile-size")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			app.tile_size=(int)strtol(argv[++optind],&p2,10);
+   			if(app.tile_size<2 || app.tile_size>65536 || *p2!=0)
+   			    {
+   			    cerr << "Bad tile size\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--bin")==0)
+   			{
+   			app.binning=true;
+   			}
+   		else if(std::strcmp(argv[optind],"--threshold")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			app.threshold=strtod(argv[++optind],&p2);
+   			if(*p2!=0 || isnan(app.threshold))
+   			    {
+   			    cerr << "Bad threshold\n";
+   			    return EXIT_FAILURE;
+   			    }
+   			}
    		else if(argv[optind][0]=='-')
    			{
    			fprintf(stderr,"unknown option '%s'\n",argv[optind]);
@@ -409,31 +1393,56 @@ int main(int argc,char** argv)
    			}
    		++optind;
                 }
-    if(optind==argc)
-	    {
-	    gzFile in=gzdopen(fileno(stdin),"r");
-	    if(in==NULL)
+    if(app.tile_dir!=NULL && ((size_t)app.tile_size<<app.zoom_levels)>(size_t)MAX_TILE_COLUMNS)
+	{
+	cerr << "--tile-size " << app.tile_size << " with --zoom " << app.zoom_levels
+	     << ": more than " << MAX_TILE_COLUMNS << " pixel columns at the deepest level\n";
+	return EXIT_FAILURE;
+	}
+    try
+	{
+	if(optind==argc)
 		{
-		cerr << "Cannot open stdin" << endl;
-		return EXIT_FAILURE;
+		BgzfReader in(stdin,app.nthreads);
+		app.readData(in);
 		}
-	    app.readData(in);
-	    }
-    else
-	    {
-	    while(optind< argc)
+	else
 		{
-		char* filename=argv[optind++];
-		gzFile in=gzopen(filename,"r");
-		if(in==NULL)
+		while(optind< argc)
 		    {
-		    cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
-		    return EXIT_FAILURE;
+		    char* filename=argv[optind++];
+		    FILE* in=fopen(filename,"rb");
+		    if(in==NULL)
+			{
+			cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+			return EXIT_FAILURE;
+			}
+			{
+			BgzfReader reader(in,app.nthreads);
+			struct stat st;
+			app.input_size=0;
+			if(!reader.compressed() && fstat(fileno(in),&st)==0 && S_ISREG(st.st_mode))
+			    {
+			    app.input_size=st.st_size;
+			    }
+			app.readData(reader);
+			}
+		    fclose(in);
 		    }
-		app.readData(in);
-		gzclose(in);
 		}
+	if(app.tile_dir!=NULL)
+	    {
+	    app.printTiles();
+	    }
+	else
+	    {
+	    app.print();
 	    }
-    app.print();
+	}
+    catch(std::exception& err)
+	{
+	cerr << err.what() << endl;
+	return EXIT_FAILURE;
+	}
     return EXIT_SUCCESS;
     }
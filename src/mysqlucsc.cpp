@@ -23,95 +23,1723 @@
 #include <algorithm>
 #include <cassert>
 #include <stdint.h>
+#include <deque>
+#include <ctime>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
 #include <mysql.h>
+#include "ucscbin.h"
+#include "bufferedwriter.h"
 
 using namespace std;
 
+#if !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID>=80001
+/* removed from mysql 8 */
+typedef bool my_bool;
+#endif
+
 #define WHERE(a) cerr << __FILE__ << ":" << __LINE__ << ":" << a << endl
 
-#define THROW(a) do{ostringstream _os;\
-	_os << __FILE__ << ":"<< __LINE__ << ":"<< a << endl;\
-	throw runtime_error(_os.str());\
-	}while(0)
+#define THROW(a) do{ostringstream _os;\
+	_os << __FILE__ << ":"<< __LINE__ << ":"<< a << endl;\
+	throw runtime_error(_os.str());\
+	}while(0)
+
+enum	{
+    select_any=0,
+    select_user_IN_sql=1,
+    select_user_OUT_sql=2
+};
+
+/** same tests as the 'where' clauses built by SqlAnnotator */
+static bool accept(int select_type,int32_t start,int32_t end,int userStart,int userEnd)
+	{
+	switch(select_type)
+	    {
+	    case select_user_IN_sql: return start<=userStart && end>=userEnd;
+	    case select_user_OUT_sql: return start>=userStart && end<=userEnd;
+	    default: return !(end<=userStart || start>userEnd);
+	    }
+	}
+
+static bool readline(gzFile in,std::string& line)
+	{
+	line.clear();
+	int c;
+	if(gzeof(in)) return false;
+	while((c=gzgetc(in))!=EOF && c!='\n')
+	    {
+	    line+=(char)c;
+	    }
+	return true;
+	}
+
+static void split(const string& line,char delim,vector<string>& tokens)
+	{
+	size_t prev=0;
+	size_t i=0;
+	tokens.clear();
+	while(i<=line.size())
+	    {
+	    if(i==line.size() || line[i]==delim)
+		{
+		tokens.push_back(line.substr(prev,i-prev));
+		if(i==line.size()) break;
+		prev=i+1;
+		}
+	    ++i;
+	    }
+	}
+
+class Table
+    {
+    private:
+	/* refGene uses txStart/txEnd, rmsk genoName/genoStart/genoEnd, psl tName/tStart/tEnd */
+	static bool isChrom(const string& s)
+	    {
+	    return s=="chrom" || s=="genoName" || s=="tName";
+	    }
+	static bool isChromStart(const string& s)
+	    {
+	    return s=="chromStart" || s=="txStart" || s=="genoStart" || s=="tStart";
+	    }
+	static bool isChromEnd(const string& s)
+	    {
+	    return s=="chromEnd" || s=="txEnd" || s=="genoEnd" || s=="tEnd";
+	    }
+    public:
+	bool hasBin;
+	string name;
+	string chrom;
+	string chromStart;
+	string chromEnd;
+	vector<string> columns;
+	Table():hasBin(false)
+	    {
+	    }
+	void add(const string& colName)
+	    {
+	    columns.push_back(colName);
+	    if(colName.compare("bin")==0)
+		{
+		hasBin=true;
+		}
+	    else if(chrom.empty() && isChrom(colName))
+		{
+		chrom=colName;
+		}
+	    else if(chromStart.empty() && isChromStart(colName))
+		{
+		chromStart=colName;
+		}
+	    else if(chromEnd.empty() && isChromEnd(colName))
+		{
+		chromEnd=colName;
+		}
+	    }
+	bool validate()
+	    {
+	    if(chrom.empty())
+		{
+		cerr << "Cannot find chrom column in "<< name << endl;
+		return false;
+		}
+	    if(chromStart.empty())
+		{
+		cerr << "Cannot find chromStart column in "<< name << endl;
+		return false;
+		}
+	    if(chromEnd.empty())
+		{
+		cerr << "Cannot find chromEnd column in "<< name << endl;
+		return false;
+		}
+	    return true;
+	    }
+    };
+
+/** an input row and the rows of the table matching it */
+class Record
+    {
+    public:
+	/* the input line, printed before each hit */
+	string line;
+	vector<string> tokens;
+	string chrom;
+	/* positions as found in the input, used for the selection */
+	int chromStart;
+	int chromEnd;
+	/* positions shifted to 0-based, used for the bins */
+	int binStart;
+	int binEnd;
+	/* each hit is a row of the table, columns joined with the delimiter */
+	vector<string> hits;
+	/* several tables: the hits of each table, see MultiAnnotator */
+	vector<vector<string> > groups;
+	/* the record could not be annotated and is not printed */
+	bool skip;
+    };
+
+/** a batch of consecutive records */
+class Job
+    {
+    public:
+	/* rank of the batch in the input */
+	size_t id;
+	vector<Record> records;
+	vector<Record*> batch;
+	/* message of the exception thrown while annotating the batch in a worker */
+	string error;
+	Job(size_t batch_size):id(0),records(batch_size)
+	    {
+	    }
+    };
+
+/** finds the rows of a table matching a Record */
+class Annotator
+    {
+    public:
+	Table* table;
+	int select_type;
+	int limit;
+	char delim;
+	Annotator(Table* table,int select_type,int limit,char delim):
+	    table(table),select_type(select_type),limit(limit),delim(delim)
+	    {
+	    }
+	virtual ~Annotator()
+	    {
+	    }
+	/** an annotator for another thread sharing the data of this one, NULL if not supported */
+	virtual Annotator* copy() const
+	    {
+	    return NULL;
+	    }
+	/** fills rec->hits, returns false if the record could not be processed */
+	virtual bool annotate(Record* rec)=0;
+	/** annotates a batch of records, sets 'skip' on those that could not be processed */
+	virtual void annotate(vector<Record*>& records)
+	    {
+	    for(size_t i=0;i< records.size();++i)
+		{
+		records[i]->skip=!annotate(records[i]);
+		}
+	    }
+    };
+
+/** several tables: the hits of the i-th annotator are moved to rec->groups[i] */
+class MultiAnnotator:public Annotator
+    {
+    private:
+	vector<Annotator*> annotators;
+	vector<char> skipped;
+    public:
+	/** owns the annotators */
+	MultiAnnotator(const vector<Annotator*>& annotators):
+	    Annotator(NULL,select_any,-1,'\t'),annotators(annotators)
+	    {
+	    }
+	virtual ~MultiAnnotator()
+	    {
+	    for(size_t i=0;i< annotators.size();++i) delete annotators[i];
+	    }
+	virtual bool annotate(Record* rec)
+	    {
+	    vector<Record*> records(1,rec);
+	    annotate(records);
+	    return !rec->skip;
+	    }
+	virtual void annotate(vector<Record*>& records)
+	    {
+	    skipped.assign(records.size(),0);
+	    for(size_t i=0;i< records.size();++i)
+		{
+		records[i]->groups.resize(annotators.size());
+		}
+	    for(size_t t=0;t< annotators.size();++t)
+		{
+		for(size_t i=0;i< records.size();++i) records[i]->hits.clear();
+		annotators[t]->annotate(records);
+		for(size_t i=0;i< records.size();++i)
+		    {
+		    if(records[i]->skip) skipped[i]=1;
+		    records[i]->groups[t].swap(records[i]->hits);
+		    }
+		}
+	    for(size_t i=0;i< records.size();++i)
+		{
+		records[i]->skip=(skipped[i]!=0);
+		}
+	    }
+    };
+
+/** one SQL query per record */
+class SqlAnnotator:public Annotator
+    {
+    protected:
+	MYSQL* mysql;
+	string columns;
+	/* last 'bin' clause and the 128kb blocks it was built for */
+	string bin_clause;
+	int bin_first;
+	int bin_last;
+
+	/* prepared statement used for one record, see prepare() */
+	MYSQL_STMT* stmt;
+	vector<MYSQL_BIND> params;
+	string chrom;
+	unsigned long chrom_length;
+	int positions[2+2*UCSC_BIN_RANGES];
+	vector<BinRange> binList;
+	/* one column of the result, fetched as a string */
+	struct Column
+	    {
+	    vector<char> buffer;
+	    unsigned long length;
+	    my_bool is_null;
+	    my_bool error;
+	    };
+	vector<Column> fields;
+	vector<MYSQL_BIND> results;
+
+	/** selection on the positions, 'start' and 'end' are values or '?' */
+	template<typename T>
+	void predicate(ostream& sql,const T& start,const T& end)
+	    {
+	    switch(select_type)
+		{
+		case select_user_IN_sql:
+		    {
+		    sql << table->chromStart << " <= " << start
+		       << " and "<< table->chromEnd << " >= " << end;
+
+		    break;
+		    }
+		case select_user_OUT_sql:
+		    {
+		    sql << table->chromStart << " >= " << start
+		       << " and "<< table->chromEnd << " <= " << end
+			;
+		    break;
+		    }
+		default:
+		    {
+		    sql << " NOT(" << table->chromEnd << " <= " << start
+		       << " or "<< table->chromStart << " > " << end
+		       << ")";
+		    break;
+		    }
+		}
+	    }
+
+	/** range given to the bins: one base of slack on each side, the records are closed ranges */
+	void binRange(const Record* rec,int& start,int& end)
+	    {
+	    start=max(0,min(rec->binStart,rec->binEnd)-1);
+	    end=max(rec->binStart,rec->binEnd)+2;
+	    }
+
+	/** 'where' clause selecting the rows of the table matching 'rec' */
+	void where(ostream& sql,const Record* rec)
+	    {
+	    sql << table->chrom << "=\"" << rec->chrom << "\" and ";
+	    predicate(sql,rec->chromStart,rec->chromEnd);
+	    if(table->hasBin)
+		{
+		int start,end;
+		binRange(rec,start,end);
+		int first=start>>UCSC_BIN_FIRST_SHIFT;
+		int last=(end-1)>>UCSC_BIN_FIRST_SHIFT;
+		/* the schemes (standard, extended or both) only depend on 'first' and 'last' */
+		if(bin_clause.empty() || first!=bin_first || last!=bin_last)
+		    {
+		    ostringstream os;
+		    binWhere(os,"bin",start,end);
+		    bin_clause.assign(os.str());
+		    bin_first=first;
+		    bin_last=last;
+		    }
+		sql << " and " << bin_clause;
+		}
+	    }
+
+	/** joins the columns of 'row' starting at 'first' */
+	void join(MYSQL_ROW row,int first,int ncols,string& hit)
+	    {
+	    hit.clear();
+	    for(int i=first;i< ncols;++i)
+		{
+		if(i>first) hit+=delim;
+		if(row[i]!=NULL) hit.append(row[i]);
+		}
+	    }
+
+	/**
+	 * server-side statement: chrom, start, end and the bins are parameters,
+	 * the columns are fetched in buffers reused from one record to another.
+	 */
+	void prepare()
+	    {
+	    ostringstream sql;
+	    sql << "select " << columns << " from "<< table->name << " where " << table->chrom << "=? and ";
+	    predicate(sql,"?","?");
+	    if(table->hasBin)
+		{
+		sql << " and (";
+		for(int i=0;i< UCSC_BIN_RANGES;++i)
+		    {
+		    if(i>0) sql << " or ";
+		    sql << "bin between ? and ?";
+		    }
+		sql << ")";
+		}
+	    if(limit>0)
+		{
+		sql << " limit "<< limit;
+		}
+	    string query(sql.str());
+	    if((stmt=::mysql_stmt_init(mysql))==NULL) THROW("Cannot init statement");
+	    if(::mysql_stmt_prepare(stmt,query.c_str(),query.size())!=0)
+		{
+		THROW("Cannot prepare "<< query << " " << ::mysql_stmt_error(stmt));
+		}
+	    params.resize(1+2+(table->hasBin?2*UCSC_BIN_RANGES:0));
+	    memset((void*)&params[0],0,sizeof(MYSQL_BIND)*params.size());
+	    params[0].buffer_type=MYSQL_TYPE_STRING;
+	    params[0].length=&chrom_length;
+	    for(size_t i=1;i< params.size();++i)
+		{
+		params[i].buffer_type=MYSQL_TYPE_LONG;
+		params[i].buffer=(void*)&positions[i-1];
+		}
+	    fields.resize(::mysql_stmt_field_count(stmt));
+	    results.resize(fields.size());
+	    if(!results.empty()) memset((void*)&results[0],0,sizeof(MYSQL_BIND)*results.size());
+	    for(size_t i=0;i< fields.size();++i)
+		{
+		fields[i].buffer.resize(256);
+		bind(i);
+		}
+	    }
+
+	void bind(size_t i)
+	    {
+	    results[i].buffer_type=MYSQL_TYPE_STRING;
+	    results[i].buffer=(void*)&(fields[i].buffer[0]);
+	    results[i].buffer_length=fields[i].buffer.size();
+	    results[i].length=&fields[i].length;
+	    results[i].is_null=&fields[i].is_null;
+	    results[i].error=&fields[i].error;
+	    }
+    public:
+	SqlAnnotator(MYSQL* mysql,Table* table,int select_type,int limit,char delim):
+	    Annotator(table,select_type,limit,delim),mysql(mysql),bin_first(-1),bin_last(-1),
+	    stmt(NULL),chrom_length(0)
+	    {
+	    for(size_t i=0;i<  table->columns.size();++i)
+		{
+		if(i>0) columns+=",";
+		columns+=table->columns[i];
+		}
+	    }
+	virtual ~SqlAnnotator()
+	    {
+	    if(stmt!=NULL) ::mysql_stmt_close(stmt);
+	    }
+
+	virtual bool annotate(Record* rec)
+	    {
+	    if(stmt==NULL) prepare();
+	    chrom.assign(rec->chrom);
+	    chrom_length=chrom.size();
+	    params[0].buffer=(void*)chrom.data();
+	    params[0].buffer_length=chrom_length;
+	    positions[0]=rec->chromStart;
+	    positions[1]=rec->chromEnd;
+	    if(table->hasBin)
+		{
+		int start,end;
+		binRange(rec,start,end);
+		binRanges(start,end,binList);
+		for(size_t i=0;i< UCSC_BIN_RANGES;++i)
+		    {
+		    /* the unused parameters are an empty range */
+		    positions[2+2*i]=(i< binList.size()?binList[i].first:1);
+		    positions[3+2*i]=(i< binList.size()?binList[i].last:0);
+		    }
+		}
+	    if(::mysql_stmt_bind_param(stmt,&params[0])!=0 ||
+	       ::mysql_stmt_execute(stmt)!=0 ||
+	       (!results.empty() && ::mysql_stmt_bind_result(stmt,&results[0])!=0))
+		{
+		cerr << "Failure for "<< rec->chrom << ":" << rec->chromStart << "-" << rec->chromEnd << "\n";
+		cerr << ::mysql_stmt_error(stmt)<< endl;
+		return false;
+		}
+	    string hit;
+	    for(;;)
+		{
+		int ret=::mysql_stmt_fetch(stmt);
+		if(ret==MYSQL_NO_DATA) break;
+		if(ret==MYSQL_DATA_TRUNCATED)
+		    {
+		    /* grow the buffers that were too small and fetch those columns again */
+		    for(size_t i=0;i< fields.size();++i)
+			{
+			if(!fields[i].error) continue;
+			fields[i].buffer.resize(fields[i].length+1);
+			bind(i);
+			if(::mysql_stmt_fetch_column(stmt,&results[i],i,0)!=0)
+			    {
+			    THROW("Cannot fetch column "<< i << " " << ::mysql_stmt_error(stmt));
+			    }
+			}
+		    ::mysql_stmt_bind_result(stmt,&results[0]);
+		    }
+		else if(ret!=0)
+		    {
+		    cerr << ::mysql_stmt_error(stmt)<< endl;
+		    ::mysql_stmt_free_result(stmt);
+		    return false;
+		    }
+		hit.clear();
+		for(size_t i=0;i< fields.size();++i)
+		    {
+		    if(i>0) hit+=delim;
+		    if(!fields[i].is_null) hit.append(&(fields[i].buffer[0]),fields[i].length);
+		    }
+		rec->hits.push_back(hit);
+		}
+	    ::mysql_stmt_free_result(stmt);
+	    return true;
+	    }
+    };
+
+/**
+ * one SQL query per batch of records: a 'union all' of the queries of
+ * SqlAnnotator, each row prefixed with the index of its record in the batch.
+ */
+class BatchSqlAnnotator:public SqlAnnotator
+    {
+    public:
+	BatchSqlAnnotator(MYSQL* mysql,Table* table,int select_type,int limit,char delim):
+	    SqlAnnotator(mysql,table,select_type,limit,delim)
+	    {
+	    }
+
+	virtual void annotate(vector<Record*>& records)
+	    {
+	    if(records.empty()) return;
+	    ostringstream sql;
+	    for(size_t i=0;i< records.size();++i)
+		{
+		if(i>0) sql << " union all ";
+		/* limit applies to one select only if it is enclosed in parentheses */
+		if(limit>0) sql << "(";
+		sql << "select " << i << "," << columns << " from "<< table->name << " where ";
+		where(sql,records[i]);
+		if(limit>0) sql << " limit "<< limit << ")";
+		records[i]->skip=false;
+		}
+	    string query(sql.str());
+
+	    MYSQL_ROW row;
+	    if(mysql_real_query( mysql, query.c_str(),query.size())!=0)
+		{
+		cerr << "Failure for "<< query << "\n";
+		cerr << mysql_error(mysql)<< endl;
+		for(size_t i=0;i< records.size();++i) records[i]->skip=true;
+		return;
+		}
+	    MYSQL_RES* res=mysql_use_result( mysql );
+	    int ncols=mysql_field_count(mysql);
+	    string hit;
+	    while(( row = mysql_fetch_row( res ))!=NULL )
+		{
+		size_t idx=(size_t)atol(row[0]);
+		if(idx>=records.size()) THROW("Bad record index "<< row[0]);
+		join(row,1,ncols,hit);
+		records[idx]->hits.push_back(hit);
+		}
+	    ::mysql_free_result( res );
+	    }
+    };
+
+#define CACHE_NAME "KeyValueDatabase"
+/* the entries that are results, not schemas ('#schema\t...') */
+#define CACHE_RESULT "substr(xKey,1,7)!='#schema'"
+/**
+ * persistent cache of the hits: a sqlite key/value table with the same
+ * layout as datastore.cpp plus the time of insertion. All the statements
+ * run in one transaction committed every 'commit_every' insertions or
+ * 'commit_seconds' seconds, so an interrupted run keeps most of its work.
+ * Each commit removes the oldest entries above 'max_entries'.
+ */
+class Cache
+    {
+    private:
+	sqlite3* connection;
+	sqlite3_stmt* stmt_get;
+	sqlite3_stmt* stmt_put;
+	pthread_mutex_t mutex;
+	size_t n_put;
+	time_t last_commit;
+	enum { commit_every=256, commit_seconds=10 };
+
+	void exec(const char* sql)
+	    {
+	    char *error=NULL;
+	    if(::sqlite3_exec(connection,sql,NULL,NULL,&error)!=SQLITE_OK)
+		{
+		string msg(error==NULL?"":error);
+		::sqlite3_free(error);
+		THROW("Cannot execute "<< sql << " " << msg);
+		}
+	    }
+
+	/** removes the oldest results above max_entries, the schemas of the tables are kept */
+	void prune()
+	    {
+	    if(max_entries<=0) return;
+	    sqlite3_stmt* stmt=NULL;
+	    sqlite3_int64 n=0;
+	    if(::sqlite3_prepare(connection,"select count(*) from " CACHE_NAME " where " CACHE_RESULT,-1,&stmt,NULL)!=SQLITE_OK)
+		{
+		THROW("Cannot count the entries " << ::sqlite3_errmsg(connection));
+		}
+	    if(::sqlite3_step(stmt)==SQLITE_ROW) n=::sqlite3_column_int64(stmt,0);
+	    ::sqlite3_finalize(stmt);
+	    if(n<=max_entries) return;
+	    ostringstream os;
+	    os << "delete from " CACHE_NAME " where xKey in (select xKey from " CACHE_NAME
+	       << " where " CACHE_RESULT " order by xTime limit " << (n-max_entries) << ")";
+	    exec(os.str().c_str());
+	    }
+
+	void commit()
+	    {
+	    prune();
+	    exec("commit");
+	    exec("begin");
+	    last_commit=time(NULL);
+	    }
+    public:
+	/* max age of an entry in seconds, ignored if <=0 */
+	long ttl;
+	/* max number of entries kept when the cache is closed, ignored if <=0 */
+	long max_entries;
+
+	Cache():connection(NULL),stmt_get(NULL),stmt_put(NULL),n_put(0),last_commit(0),ttl(-1),max_entries(-1)
+	    {
+	    ::pthread_mutex_init(&mutex,NULL);
+	    }
+	~Cache()
+	    {
+	    close();
+	    ::pthread_mutex_destroy(&mutex);
+	    }
+
+	int open(const char* filename)
+	    {
+	    if(::sqlite3_open(filename,&connection)!=SQLITE_OK)
+		{
+		cerr << "Cannot open sqlite file "<< filename <<".\n";
+		connection=NULL;
+		return EXIT_FAILURE;
+		}
+	    exec("PRAGMA synchronous=OFF");
+	    exec("create table if not exists " CACHE_NAME "(xKey TEXT NOT NULL PRIMARY KEY ASC,xData TEXT NOT NULL,xTime INTEGER NOT NULL DEFAULT 0)");
+	    /* the oldest entries are found by prune() */
+	    exec("create index if not exists " CACHE_NAME "Time on " CACHE_NAME "(xTime)");
+	    if(::sqlite3_prepare(connection,
+		    "select xData,xTime from " CACHE_NAME " where xKey=?",
+		    -1,&stmt_get,NULL )!=SQLITE_OK)
+		{
+		cerr <<"Cannot compile select statement.\n"<< endl;
+		return EXIT_FAILURE;
+		}
+	    if(::sqlite3_prepare(connection,
+		    "insert or replace into " CACHE_NAME "(xKey,xData,xTime) values(?,?,?)",
+		    -1,&stmt_put,NULL )!=SQLITE_OK)
+		{
+		cerr <<"Cannot compile insert statement.\n"<< endl;
+		return EXIT_FAILURE;
+		}
+	    exec("begin");
+	    /* a previous run may have been interrupted above the limit */
+	    commit();
+	    return EXIT_SUCCESS;
+	    }
+
+	void close()
+	    {
+	    if(connection==NULL) return;
+	    if(stmt_get!=NULL) ::sqlite3_finalize(stmt_get);
+	    if(stmt_put!=NULL) ::sqlite3_finalize(stmt_put);
+	    stmt_get=NULL;
+	    stmt_put=NULL;
+	    prune();
+	    exec("commit");
+	    ::sqlite3_close(connection);
+	    connection=NULL;
+	    }
+
+	/** returns false if the key is missing or has expired */
+	bool get(const string& key,string& data)
+	    {
+	    bool found=false;
+	    ::pthread_mutex_lock(&mutex);
+	    ::sqlite3_reset(stmt_get);
+	    if(::sqlite3_bind_text(stmt_get,1,key.data(),key.size(),NULL)!=SQLITE_OK)
+		{
+		::pthread_mutex_unlock(&mutex);
+		THROW("Cannot bind key");
+		}
+	    if(::sqlite3_step(stmt_get)==SQLITE_ROW &&
+		(ttl<=0 || (long)(time(NULL)-::sqlite3_column_int64(stmt_get,1))<=ttl))
+		{
+		data.assign(
+		    (const char*)::sqlite3_column_blob(stmt_get,0),
+		    ::sqlite3_column_bytes(stmt_get,0));
+		found=true;
+		}
+	    ::sqlite3_reset(stmt_get);
+	    ::pthread_mutex_unlock(&mutex);
+	    return found;
+	    }
+
+	void put(const string& key,const string& data)
+	    {
+	    ::pthread_mutex_lock(&mutex);
+	    ::sqlite3_reset(stmt_put);
+	    if(::sqlite3_bind_text(stmt_put,1,key.data(),key.size(),NULL)!=SQLITE_OK ||
+	       ::sqlite3_bind_text(stmt_put,2,data.data(),data.size(),NULL)!=SQLITE_OK ||
+	       ::sqlite3_bind_int64(stmt_put,3,(sqlite3_int64)time(NULL))!=SQLITE_OK ||
+	       ::sqlite3_step(stmt_put)!=SQLITE_DONE)
+		{
+		::pthread_mutex_unlock(&mutex);
+		THROW("Cannot insert "<< key << " " << ::sqlite3_errmsg(connection));
+		}
+	    ::sqlite3_reset(stmt_put);
+	    if(++n_put%commit_every==0 || time(NULL)-last_commit>=commit_seconds)
+		{
+		try
+		    {
+		    commit();
+		    }
+		catch(...)
+		    {
+		    ::pthread_mutex_unlock(&mutex);
+		    throw;
+		    }
+		}
+	    ::pthread_mutex_unlock(&mutex);
+	    }
+    };
+
+/**
+ * answers the records from a Cache, the missing records are sent to
+ * 'delegate' (or reported if delegate is NULL, that is, offline)
+ */
+class CachedAnnotator:public Annotator
+    {
+    private:
+	Annotator* delegate;
+	Cache* cache;
+	/* identifies the schema of the table and the selection */
+	string version;
+	vector<Record*> missing;
+	vector<string> keys;
+
+	void key(const Record* rec,string& k)
+	    {
+	    ostringstream os;
+	    os << version << '\t' << rec->chrom
+	       << '\t' << rec->chromStart << '\t' << rec->chromEnd
+	       << '\t' << rec->binStart << '\t' << rec->binEnd;
+	    k.assign(os.str());
+	    }
+    public:
+	/** the annotator owns 'delegate' */
+	CachedAnnotator(Annotator* delegate,Cache* cache,const string& version,Table* table,int select_type,int limit,char delim):
+	    Annotator(table,select_type,limit,delim),delegate(delegate),cache(cache),version(version)
+	    {
+	    }
+	virtual ~CachedAnnotator()
+	    {
+	    if(delegate!=NULL) delete delegate;
+	    }
+
+	virtual bool annotate(Record* rec)
+	    {
+	    vector<Record*> records(1,rec);
+	    annotate(records);
+	    return !rec->skip;
+	    }
+
+	virtual void annotate(vector<Record*>& records)
+	    {
+	    string data;
+	    missing.clear();
+	    keys.clear();
+	    for(size_t i=0;i< records.size();++i)
+		{
+		Record* rec=records[i];
+		string k;
+		key(rec,k);
+		rec->skip=false;
+		if(!cache->get(k,data))
+		    {
+		    missing.push_back(rec);
+		    keys.push_back(k);
+		    continue;
+		    }
+		/* each hit is followed by a new line */
+		size_t prev=0,i2;
+		while((i2=data.find('\n',prev))!=string::npos)
+		    {
+		    rec->hits.push_back(data.substr(prev,i2-prev));
+		    prev=i2+1;
+		    }
+		}
+	    if(missing.empty()) return;
+	    if(delegate==NULL)
+		{
+		for(size_t i=0;i< missing.size();++i)
+		    {
+		    cerr << "Not in cache: "<< missing[i]->chrom << ":"
+			 << missing[i]->chromStart << "-" << missing[i]->chromEnd << endl;
+		    missing[i]->skip=true;
+		    }
+		return;
+		}
+	    delegate->annotate(missing);
+	    for(size_t i=0;i< missing.size();++i)
+		{
+		Record* rec=missing[i];
+		if(rec->skip) continue;
+		data.clear();
+		for(size_t j=0;j< rec->hits.size();++j)
+		    {
+		    data.append(rec->hits[j]);
+		    data+='\n';
+		    }
+		cache->put(keys[i],data);
+		}
+	    }
+    };
+
+/** a row of the table held in memory */
+struct Interval
+    {
+    int32_t start;
+    int32_t end;
+    /* max end of the subtree, see IntervalIndex */
+    int32_t maxEnd;
+    string row;
+    bool operator < (const Interval& cp) const
+	{
+	return start < cp.start;
+	}
+    };
+
+/**
+ * 'nodes' are sorted on start and viewed as an implicit binary tree
+ * (node i has level = number of trailing 1-bits of i) where each node
+ * stores in maxEnd the max end of its subtree. Finds the nodes with
+ * node.start<=end && node.end>=start, ordered on start.
+ */
+template<typename T>
+static void overlapping(const T* nodes,size_t n,int max_level,int32_t start,int32_t end,vector<const T*>& hits)
+	{
+	struct Node { size_t x; int k; bool visited; };
+	Node stack[64];
+	if(max_level<0) return;
+	int t=0;
+	stack[t].k=max_level;
+	stack[t].x=((size_t)1<<max_level)-1;
+	stack[t].visited=false;
+	++t;
+	while(t>0)
+	    {
+	    Node z=stack[--t];
+	    if(z.k<=3)
+		{
+		/* small subtree: linear scan */
+		size_t i0=(z.x>>z.k)<<z.k;
+		size_t i1=i0+((size_t)1<<(z.k+1))-1;
+		if(i1>n) i1=n;
+		for(size_t i=i0;i< i1 && nodes[i].start<=end;++i)
+		    {
+		    if(nodes[i].end>=start) hits.push_back(&nodes[i]);
+		    }
+		}
+	    else if(!z.visited)
+		{
+		size_t y=z.x-((size_t)1<<(z.k-1));
+		z.visited=true;
+		stack[t++]=z;
+		if(y>=n || nodes[y].maxEnd>=start)
+		    {
+		    stack[t].x=y;
+		    stack[t].k=z.k-1;
+		    stack[t].visited=false;
+		    ++t;
+		    }
+		}
+	    else if(z.x<n && nodes[z.x].start<=end)
+		{
+		if(nodes[z.x].end>=start) hits.push_back(&nodes[z.x]);
+		stack[t].x=z.x+((size_t)1<<(z.k-1));
+		stack[t].k=z.k-1;
+		stack[t].visited=false;
+		++t;
+		}
+	    }
+	}
+
+/** intervals of one chromosome, see overlapping() */
+class IntervalIndex
+    {
+    public:
+	vector<Interval> intervals;
+	int max_level;
+
+	IntervalIndex():max_level(-1)
+	    {
+	    }
+
+	void index()
+	    {
+	    std::sort(intervals.begin(),intervals.end());
+	    size_t n=intervals.size();
+	    max_level=-1;
+	    if(n==0) return;
+	    size_t last_i=0;
+	    int32_t last=0;
+	    for(size_t i=0;i< n;i+=2)
+		{
+		last_i=i;
+		last=intervals[i].maxEnd=intervals[i].end;
+		}
+	    int k;
+	    for(k=1;((size_t)1<<k)<=n;++k)
+		{
+		size_t x=(size_t)1<<(k-1);
+		size_t step=x<<2;
+		for(size_t i=(x<<1)-1;i< n;i+=step)
+		    {
+		    int32_t el=intervals[i-x].maxEnd;
+		    int32_t er=(i+x<n?intervals[i+x].maxEnd:last);
+		    int32_t e=intervals[i].end;
+		    e=max(e,el);
+		    e=max(e,er);
+		    intervals[i].maxEnd=e;
+		    }
+		last_i=((last_i>>k)&1)?last_i-x:last_i+x;
+		if(last_i<n && intervals[last_i].maxEnd>last) last=intervals[last_i].maxEnd;
+		}
+	    max_level=k-1;
+	    }
+
+	void overlapping(int32_t start,int32_t end,vector<const Interval*>& hits) const
+	    {
+	    if(intervals.empty()) return;
+	    ::overlapping(&intervals[0],intervals.size(),max_level,start,end,hits);
+	    }
+    };
+
+#define LOCAL_MAGIC "UCSCIDX1"
+#define LOCAL_MAGIC_SIZE 8
+
+/**
+ * an Interval in the file written by IndexAnnotator::save. The file is:
+ * magic, columns, chrom/chromStart/chromEnd columns, then for each
+ * chromosome: name, offset and count of its FileIntervals, max_level.
+ * The FileIntervals (aligned on 8 bytes) of each chromosome are an
+ * IntervalIndex, the rows of the table (tab delimited) follow them.
+ * Integers are in the byte order of the machine.
+ */
+struct FileInterval
+    {
+    int32_t start;
+    int32_t end;
+    int32_t maxEnd;
+    /* the row of the table */
+    uint32_t length;
+    uint64_t offset;
+    };
+
+/** a memory-mapped file written by IndexAnnotator::save */
+class LocalFile
+    {
+    public:
+	struct Chrom
+	    {
+	    const FileInterval* intervals;
+	    size_t count;
+	    int max_level;
+	    };
+	typedef map<string,Chrom> chrom2index_t;
+	chrom2index_t chrom2index;
+	vector<string> columns;
+	string chrom;
+	string chromStart;
+	string chromEnd;
+	const char* base;
+	size_t length;
+
+	static void put(string& out,uint32_t v)
+	    {
+	    out.append((const char*)&v,sizeof(v));
+	    }
+	static void put(string& out,uint64_t v)
+	    {
+	    out.append((const char*)&v,sizeof(v));
+	    }
+	static void put(string& out,const string& s)
+	    {
+	    put(out,(uint32_t)s.size());
+	    out.append(s);
+	    }
+    private:
+	size_t pos;
+
+	void check(size_t n)
+	    {
+	    if(pos+n>length) THROW("Truncated index file");
+	    }
+	template<typename T>
+	T get()
+	    {
+	    T v;
+	    check(sizeof(T));
+	    memcpy(&v,&base[pos],sizeof(T));
+	    pos+=sizeof(T);
+	    return v;
+	    }
+	string getString()
+	    {
+	    uint32_t n=get<uint32_t>();
+	    check(n);
+	    string s(&base[pos],n);
+	    pos+=n;
+	    return s;
+	    }
+    public:
+	LocalFile():base(NULL),length(0),pos(0)
+	    {
+	    }
+	~LocalFile()
+	    {
+	    if(base!=NULL) ::munmap((void*)base,length);
+	    }
+
+	int open(const char* filename)
+	    {
+	    int fd=::open(filename,O_RDONLY);
+	    if(fd==-1)
+		{
+		cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+		return EXIT_FAILURE;
+		}
+	    struct stat st;
+	    if(::fstat(fd,&st)!=0 || st.st_size< LOCAL_MAGIC_SIZE)
+		{
+		cerr << "Cannot read "<< filename << endl;
+		::close(fd);
+		return EXIT_FAILURE;
+		}
+	    length=st.st_size;
+	    void* p=::mmap(NULL,length,PROT_READ,MAP_SHARED,fd,0);
+	    ::close(fd);
+	    if(p==MAP_FAILED)
+		{
+		cerr << "Cannot mmap "<< filename << " " << strerror(errno) << endl;
+		return EXIT_FAILURE;
+		}
+	    base=(const char*)p;
+	    if(memcmp(base,LOCAL_MAGIC,LOCAL_MAGIC_SIZE)!=0)
+		{
+		cerr << filename << " is not an index file" << endl;
+		return EXIT_FAILURE;
+		}
+	    pos=LOCAL_MAGIC_SIZE;
+	    uint32_t n=get<uint32_t>();
+	    for(uint32_t i=0;i< n;++i)
+		{
+		columns.push_back(getString());
+		}
+	    chrom=getString();
+	    chromStart=getString();
+	    chromEnd=getString();
+	    n=get<uint32_t>();
+	    for(uint32_t i=0;i< n;++i)
+		{
+		string name=getString();
+		uint64_t offset=get<uint64_t>();
+		Chrom c;
+		c.count=get<uint64_t>();
+		c.max_level=(int32_t)get<uint32_t>();
+		if(offset%8!=0 || offset+c.count*sizeof(FileInterval)>length)
+		    {
+		    cerr << "Bad offset for "<< name << " in "<< filename << endl;
+		    return EXIT_FAILURE;
+		    }
+		c.intervals=(const FileInterval*)&base[offset];
+		chrom2index.insert(make_pair(name,c));
+		}
+	    return EXIT_SUCCESS;
+	    }
+    };
+
+/** answers the records from a LocalFile, nothing is loaded */
+class LocalAnnotator:public Annotator
+    {
+    private:
+	LocalFile* file;
+	/* columns of the file printed, in this order */
+	vector<size_t> selected;
+	vector<const FileInterval*> candidates;
+	vector<string> tokens;
+	string row;
+    public:
+	LocalAnnotator(LocalFile* file,Table* table,int select_type,int limit,char delim):
+	    Annotator(table,select_type,limit,delim),file(file)
+	    {
+	    if(table->columns!=file->columns)
+		{
+		for(size_t i=0;i< table->columns.size();++i)
+		    {
+		    vector<string>::const_iterator r=std::find(file->columns.begin(),file->columns.end(),table->columns[i]);
+		    if(r==file->columns.end()) THROW("Cannot find column "<< table->columns[i]<< " in " << table->name);
+		    selected.push_back(r-file->columns.begin());
+		    }
+		}
+	    }
+
+	virtual Annotator* copy() const
+	    {
+	    return new LocalAnnotator(*this);
+	    }
+
+	virtual bool annotate(Record* rec)
+	    {
+	    LocalFile::chrom2index_t::const_iterator r=file->chrom2index.find(rec->chrom);
+	    if(r==file->chrom2index.end()) return true;
+	    candidates.clear();
+	    ::overlapping(r->second.intervals,r->second.count,r->second.max_level,
+		min(rec->chromStart,rec->chromEnd),
+		max(rec->chromStart,rec->chromEnd),
+		candidates);
+	    for(size_t i=0;i< candidates.size();++i)
+		{
+		const FileInterval* c=candidates[i];
+		if(limit>0 && rec->hits.size()>=(size_t)limit) break;
+		if(!accept(select_type,c->start,c->end,rec->chromStart,rec->chromEnd)) continue;
+		if(c->offset+c->length>file->length) THROW("Bad offset in index file");
+		row.assign(&file->base[c->offset],c->length);
+		if(!selected.empty())
+		    {
+		    split(row,'\t',tokens);
+		    if(tokens.size()!=file->columns.size()) THROW("Expected "<< file->columns.size() << " columns in " << row);
+		    row.clear();
+		    for(size_t j=0;j< selected.size();++j)
+			{
+			if(j>0) row+=delim;
+			row.append(tokens[selected[j]]);
+			}
+		    }
+		else if(delim!='\t')
+		    {
+		    std::replace(row.begin(),row.end(),'\t',delim);
+		    }
+		rec->hits.push_back(row);
+		}
+	    return true;
+	    }
+    };
+
+/** the whole table is loaded once, records are answered from memory */
+class IndexAnnotator:public Annotator
+    {
+    private:
+	typedef map<string,IntervalIndex*> chrom2index_t;
+	chrom2index_t chrom2index;
+	/* false for a copy() */
+	bool owner;
+	vector<const Interval*> candidates;
+
+	void add(const string& chrom,int32_t start,int32_t end,const string& row)
+	    {
+	    IntervalIndex* idx;
+	    chrom2index_t::iterator r=chrom2index.find(chrom);
+	    if(r==chrom2index.end())
+		{
+		idx=new IntervalIndex;
+		chrom2index.insert(make_pair(chrom,idx));
+		}
+	    else
+		{
+		idx=r->second;
+		}
+	    Interval i;
+	    i.start=start;
+	    i.end=end;
+	    i.row=row;
+	    idx->intervals.push_back(i);
+	    }
+
+	void index()
+	    {
+	    for(chrom2index_t::iterator r=chrom2index.begin();r!=chrom2index.end();++r)
+		{
+		r->second->index();
+		}
+	    }
+    public:
+	IndexAnnotator(Table* table,int select_type,int limit,char delim):
+	    Annotator(table,select_type,limit,delim),owner(true)
+	    {
+	    }
+	virtual ~IndexAnnotator()
+	    {
+	    if(!owner) return;
+	    for(chrom2index_t::iterator r=chrom2index.begin();r!=chrom2index.end();++r)
+		{
+		delete r->second;
+		}
+	    }
+
+	/** shares the index of this one, must be deleted first */
+	virtual Annotator* copy() const
+	    {
+	    IndexAnnotator* a=new IndexAnnotator(*this);
+	    a->owner=false;
+	    return a;
+	    }
+
+	/** streams the table from the server with mysql_use_result */
+	void load(MYSQL* mysql)
+	    {
+	    ostringstream os;
+	    os << "select ";
+	    for(size_t i=0;i<  table->columns.size();++i)
+		{
+		os << table->columns[i] << ",";
+		}
+	    os << table->chrom << "," << table->chromStart << "," << table->chromEnd
+	       << " from "<< table->name;
+	    string query(os.str());
+	    if(mysql_real_query( mysql, query.c_str(),query.size())!=0)
+		{
+		THROW("Failure for "<< query << " " << mysql_error(mysql));
+		}
+	    MYSQL_RES* res=mysql_use_result( mysql );
+	    size_t ncols=table->columns.size();
+	    MYSQL_ROW row;
+	    string hit;
+	    while(( row = mysql_fetch_row( res ))!=NULL )
+		{
+		if(row[ncols]==NULL || row[ncols+1]==NULL || row[ncols+2]==NULL) continue;
+		hit.clear();
+		for(size_t i=0;i< ncols;++i)
+		    {
+		    if(i>0) hit+=delim;
+		    if(row[i]!=NULL) hit.append(row[i]);
+		    }
+		add(row[ncols],atoi(row[ncols+1]),atoi(row[ncols+2]),hit);
+		}
+	    ::mysql_free_result( res );
+	    index();
+	    }
+
+	/** reads the rows of a tab delimited dump, 'header' is its list of columns */
+	void load(gzFile in,const vector<string>& header)
+	    {
+	    vector<size_t> selected;
+	    size_t chromIdx=0,startIdx=0,endIdx=0;
+	    for(size_t i=0;i< header.size();++i)
+		{
+		if(header[i]==table->chrom) chromIdx=i;
+		if(header[i]==table->chromStart) startIdx=i;
+		if(header[i]==table->chromEnd) endIdx=i;
+		}
+	    for(size_t i=0;i< table->columns.size();++i)
+		{
+		vector<string>::const_iterator r=std::find(header.begin(),header.end(),table->columns[i]);
+		if(r==header.end()) THROW("Cannot find column "<< table->columns[i]<< " in " << table->name);
+		selected.push_back(r-header.begin());
+		}
+	    string line;
+	    string hit;
+	    vector<string> tokens;
+	    while(readline(in,line))
+		{
+		if(line.empty() || line[0]=='#') continue;
+		split(line,'\t',tokens);
+		if(tokens.size()!=header.size())
+		    {
+		    THROW("Expected "<< header.size() << " columns in " << line);
+		    }
+		hit.clear();
+		for(size_t i=0;i< selected.size();++i)
+		    {
+		    if(i>0) hit+=delim;
+		    hit.append(tokens[selected[i]]);
+		    }
+		add(tokens[chromIdx],atoi(tokens[startIdx].c_str()),atoi(tokens[endIdx].c_str()),hit);
+		}
+	    index();
+	    }
+
+	/**
+	 * writes the index in the binary format read by LocalFile, the
+	 * rows of the table must have been joined with a tab
+	 */
+	void save(const char* filename)
+	    {
+	    string head;
+	    size_t head_size=0;
+	    uint64_t offset=0;
+	    /* the header is built twice: its size gives the offset of the intervals */
+	    for(int pass=0;pass<2;++pass)
+		{
+		head.assign(LOCAL_MAGIC,LOCAL_MAGIC_SIZE);
+		LocalFile::put(head,(uint32_t)table->columns.size());
+		for(size_t i=0;i< table->columns.size();++i)
+		    {
+		    LocalFile::put(head,table->columns[i]);
+		    }
+		LocalFile::put(head,table->chrom);
+		LocalFile::put(head,table->chromStart);
+		LocalFile::put(head,table->chromEnd);
+		LocalFile::put(head,(uint32_t)chrom2index.size());
+		offset=head_size;
+		for(chrom2index_t::iterator r=chrom2index.begin();r!=chrom2index.end();++r)
+		    {
+		    offset+=(8-offset%8)%8;
+		    LocalFile::put(head,r->first);
+		    LocalFile::put(head,offset);
+		    LocalFile::put(head,(uint64_t)r->second->intervals.size());
+		    LocalFile::put(head,(uint32_t)r->second->max_level);
+		    offset+=r->second->intervals.size()*sizeof(FileInterval);
+		    }
+		head_size=head.size();
+		}
+	    FILE* out=fopen(filename,"wb");
+	    if(out==NULL) THROW("Cannot open "<< filename << " " << strerror(errno));
+	    /* the intervals, then the rows */
+		{
+		BufferedWriter w(out);
+		w.write(head);
+		uint64_t pos=head.size();
+		for(chrom2index_t::iterator r=chrom2index.begin();r!=chrom2index.end();++r)
+		    {
+		    while(pos%8!=0) { w.write('\0'); ++pos;}
+		    const vector<Interval>& intervals=r->second->intervals;
+		    for(size_t i=0;i< intervals.size();++i)
+			{
+			FileInterval f;
+			f.start=intervals[i].start;
+			f.end=intervals[i].end;
+			f.maxEnd=intervals[i].maxEnd;
+			f.length=intervals[i].row.size();
+			f.offset=offset;
+			offset+=f.length;
+			w.write((const char*)&f,sizeof(FileInterval));
+			pos+=sizeof(FileInterval);
+			}
+		    }
+		for(chrom2index_t::iterator r=chrom2index.begin();r!=chrom2index.end();++r)
+		    {
+		    const vector<Interval>& intervals=r->second->intervals;
+		    for(size_t i=0;i< intervals.size();++i)
+			{
+			w.write(intervals[i].row);
+			}
+		    }
+		}
+	    if(ferror(out) || fclose(out)!=0) THROW("Cannot write "<< filename << " " << strerror(errno));
+	    }
+
+	virtual bool annotate(Record* rec)
+	    {
+	    chrom2index_t::iterator r=chrom2index.find(rec->chrom);
+	    if(r==chrom2index.end()) return true;
+	    candidates.clear();
+	    r->second->overlapping(
+		min(rec->chromStart,rec->chromEnd),
+		max(rec->chromStart,rec->chromEnd),
+		candidates);
+	    for(size_t i=0;i< candidates.size();++i)
+		{
+		const Interval* c=candidates[i];
+		if(limit>0 && rec->hits.size()>=(size_t)limit) break;
+		if(!accept(select_type,c->start,c->end,rec->chromStart,rec->chromEnd)) continue;
+		rec->hits.push_back(c->row);
+		}
+	    return true;
+	    }
+    };
 
-static void binsInRange(
-        int chromStart,
-        int chromEnd,
-        int binId,
-        int level,
-        int binRowStart,
-        int rowIndex,
-        int binRowCount,
-        int genomicPos,
-        int genomicLength,
-        vector<int>& binList
-        )
-        {
-	binList.push_back(binId);
-        if(level<4)
-		{
-		int i;
-		int childLength=genomicLength/8;
-		int childBinRowCount=binRowCount*8;
-		int childRowBinStart=binRowStart+binRowCount;
-		int firstChildIndex=rowIndex*8;
-		int firstChildBin=childRowBinStart+firstChildIndex;
-		for(i=0;i< 8;++i)
-		        {
-		        int childStart=genomicPos+i*childLength;
-
-		        if( chromStart>(childStart+childLength) ||
-		                chromEnd<childStart )
-		                {
-		                continue;
-		                }
-		        binsInRange(
-		                chromStart,
-		                chromEnd,
-		                firstChildBin+i,
-		                level+1,
-		                childRowBinStart,
-		                firstChildIndex+i,
-		                childBinRowCount,
-		                childStart,
-		                childLength,
-				binList
-		                );
-		        }
-		}
-        }
-
-
-
-static void bins(int chromStart,int chromEnd,vector<int>& binList)
+/** orders Interval by end, smallest on top of the heap */
+struct IntervalEndCmp
+    {
+    bool operator() (const Interval& a, const Interval& b) const
 	{
-	int genomicLength=536870912;
-	binList.clear();
-	binsInRange(chromStart,chromEnd,0,0,0,0,1,0,genomicLength,binList);
+	return a.end > b.end;
 	}
+    };
 
-enum	{
-    select_any=0,
-    select_user_IN_sql=1,
-    select_user_OUT_sql=2
-};
+struct IntervalPtrStartCmp
+    {
+    bool operator() (const Interval* a, const Interval* b) const
+	{
+	return a->start < b->start;
+	}
+    };
 
-class Table
+/**
+ * input is sorted on chrom/start: one ordered query per chromosome is
+ * merged with the input. Only the rows of the table that may still overlap
+ * the next records are kept in 'active'.
+ */
+class SweepAnnotator:public Annotator
     {
-    public:
-	bool hasBin;
-	string name;
+    private:
+	MYSQL* mysql;
+	MYSQL_RES* res;
+	string base_query;
 	string chrom;
-	string chromStart;
-	string chromEnd;
-	vector<string> columns;
+	set<string> seen;
+	int prevStart;
+	bool has_next;
+	Interval next;
+	vector<Interval> active;
+	vector<const Interval*> candidates;
+
+	void fetch()
+	    {
+	    MYSQL_ROW row;
+	    size_t ncols=table->columns.size();
+	    while(( row = mysql_fetch_row( res ))!=NULL )
+		{
+		if(row[ncols]==NULL || row[ncols+1]==NULL) continue;
+		next.row.clear();
+		for(size_t i=0;i< ncols;++i)
+		    {
+		    if(i>0) next.row+=delim;
+		    if(row[i]!=NULL) next.row.append(row[i]);
+		    }
+		next.start=atoi(row[ncols]);
+		next.end=atoi(row[ncols+1]);
+		has_next=true;
+		return;
+		}
+	    has_next=false;
+	    }
+
+	void close()
+	    {
+	    if(res!=NULL) ::mysql_free_result( res );
+	    res=NULL;
+	    has_next=false;
+	    active.clear();
+	    }
+
+	void open(const string& c)
+	    {
+	    close();
+	    if(seen.find(c)!=seen.end())
+		{
+		THROW("Input is not sorted: "<< c << " was already seen.");
+		}
+	    seen.insert(c);
+	    chrom.assign(c);
+	    prevStart=INT_MIN;
+	    ostringstream sql;
+	    sql << base_query << c << "\" order by " << table->chromStart;
+	    string query(sql.str());
+	    if(mysql_real_query( mysql, query.c_str(),query.size())!=0)
+		{
+		THROW("Failure for "<< query << " " << mysql_error(mysql));
+		}
+	    res=mysql_use_result( mysql );
+	    fetch();
+	    }
+    public:
+	SweepAnnotator(MYSQL* mysql,Table* table,int select_type,int limit,char delim):
+	    Annotator(table,select_type,limit,delim),mysql(mysql),res(NULL),
+	    prevStart(INT_MIN),has_next(false)
+	    {
+	    ostringstream os;
+	    os << "select ";
+	    for(size_t i=0;i<  table->columns.size();++i)
+		{
+		os << table->columns[i] << ",";
+		}
+	    os << table->chromStart << "," << table->chromEnd
+	       << " from "<< table->name << " where " << table->chrom << "=\"" ;
+	    base_query.assign(os.str());
+	    }
+	virtual ~SweepAnnotator()
+	    {
+	    close();
+	    }
+
+	virtual bool annotate(Record* rec)
+	    {
+	    int32_t start=min(rec->chromStart,rec->chromEnd);
+	    int32_t end=max(rec->chromStart,rec->chromEnd);
+	    if(res==NULL || rec->chrom!=chrom) open(rec->chrom);
+	    if(start< prevStart)
+		{
+		THROW("Input is not sorted on "<< chrom << ": "<< start << " after " << prevStart);
+		}
+	    prevStart=start;
+	    /* rows starting before the end of this record enter the active set */
+	    while(has_next && next.start<=end)
+		{
+		active.push_back(next);
+		std::push_heap(active.begin(),active.end(),IntervalEndCmp());
+		fetch();
+		}
+	    /* rows ending before this record cannot overlap the next records */
+	    while(!active.empty() && active.front().end<start)
+		{
+		std::pop_heap(active.begin(),active.end(),IntervalEndCmp());
+		active.pop_back();
+		}
+	    candidates.clear();
+	    for(size_t i=0;i< active.size();++i)
+		{
+		const Interval* c=&active[i];
+		if(c->start>end) continue;
+		if(!accept(select_type,c->start,c->end,rec->chromStart,rec->chromEnd)) continue;
+		candidates.push_back(c);
+		}
+	    std::sort(candidates.begin(),candidates.end(),IntervalPtrStartCmp());
+	    for(size_t i=0;i< candidates.size();++i)
+		{
+		if(limit>0 && rec->hits.size()>=(size_t)limit) break;
+		rec->hits.push_back(candidates[i]->row);
+		}
+	    return true;
+	    }
+    };
+
+/**
+ * N threads, each with its own Annotator (and its own mysql connection),
+ * annotate the jobs of a bounded queue. Annotated jobs wait in a reorder
+ * buffer until they can be returned in input order.
+ */
+class WorkerPool
+    {
+    private:
+	struct Worker
+	    {
+	    pthread_t thread;
+	    WorkerPool* pool;
+	    Annotator* annotator;
+	    };
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_todo;
+	pthread_cond_t cond_done;
+	vector<Worker> workers;
+	vector<Job*> jobs;
+	/* jobs printed and given back, ready to be filled again */
+	vector<Job*> free_jobs;
+	deque<Job*> todo;
+	map<size_t,Job*> done;
+	size_t capacity;
+	size_t batch_size;
+	size_t next_in;
+	size_t next_out;
+	bool finished;
+
+	static void* work(void* ptr)
+	    {
+	    Worker* w=(Worker*)ptr;
+	    WorkerPool* pool=w->pool;
+	    ::mysql_thread_init();
+	    for(;;)
+		{
+		::pthread_mutex_lock(&pool->mutex);
+		while(pool->todo.empty() && !pool->finished)
+		    {
+		    ::pthread_cond_wait(&pool->cond_todo,&pool->mutex);
+		    }
+		if(pool->todo.empty())
+		    {
+		    ::pthread_mutex_unlock(&pool->mutex);
+		    break;
+		    }
+		Job* job=pool->todo.front();
+		pool->todo.pop_front();
+		::pthread_mutex_unlock(&pool->mutex);
+
+		/* an exception cannot leave the thread: it is thrown again by next() */
+		try
+		    {
+		    w->annotator->annotate(job->batch);
+		    }
+		catch(std::exception& err)
+		    {
+		    job->error.assign(err.what());
+		    }
+
+		::pthread_mutex_lock(&pool->mutex);
+		pool->done.insert(make_pair(job->id,job));
+		::pthread_cond_signal(&pool->cond_done);
+		::pthread_mutex_unlock(&pool->mutex);
+		}
+	    ::mysql_thread_end();
+	    return NULL;
+	    }
+    public:
+	/** the pool owns the annotators */
+	WorkerPool(const vector<Annotator*>& annotators,size_t batch_size):
+	    workers(annotators.size()),
+	    capacity(annotators.size()*2),
+	    batch_size(batch_size),
+	    next_in(0),
+	    next_out(0),
+	    finished(false)
+	    {
+	    ::pthread_mutex_init(&mutex,NULL);
+	    ::pthread_cond_init(&cond_todo,NULL);
+	    ::pthread_cond_init(&cond_done,NULL);
+	    for(size_t i=0;i< workers.size();++i)
+		{
+		workers[i].pool=this;
+		workers[i].annotator=annotators[i];
+		if(::pthread_create(&(workers[i].thread),NULL,WorkerPool::work,(void*)&workers[i])!=0)
+		    {
+		    THROW("cannot create thread "<< i);
+		    }
+		}
+	    }
+
+	~WorkerPool()
+	    {
+	    ::pthread_mutex_lock(&mutex);
+	    finished=true;
+	    /* after an error, the jobs not started yet are dropped */
+	    todo.clear();
+	    ::pthread_cond_broadcast(&cond_todo);
+	    ::pthread_mutex_unlock(&mutex);
+	    for(size_t i=0;i< workers.size();++i)
+		{
+		::pthread_join(workers[i].thread,NULL);
+		delete workers[i].annotator;
+		}
+	    for(size_t i=0;i< jobs.size();++i) delete jobs[i];
+	    ::pthread_cond_destroy(&cond_done);
+	    ::pthread_cond_destroy(&cond_todo);
+	    ::pthread_mutex_destroy(&mutex);
+	    }
+
+	/** a free job, NULL if 'capacity' jobs are already in use */
+	Job* take()
+	    {
+	    if(!free_jobs.empty())
+		{
+		Job* job=free_jobs.back();
+		free_jobs.pop_back();
+		return job;
+		}
+	    if(jobs.size()>=capacity) return NULL;
+	    Job* job=new Job(batch_size);
+	    jobs.push_back(job);
+	    return job;
+	    }
+
+	/** gives back a job returned by take() or next() once it has been printed */
+	void release(Job* job)
+	    {
+	    job->batch.clear();
+	    free_jobs.push_back(job);
+	    }
+
+	void submit(Job* job)
+	    {
+	    ::pthread_mutex_lock(&mutex);
+	    job->id=next_in++;
+	    todo.push_back(job);
+	    ::pthread_cond_signal(&cond_todo);
+	    ::pthread_mutex_unlock(&mutex);
+	    }
+
+	/**
+	 * waits for the next annotated job in input order, NULL if no job is
+	 * pending. Throws the error of a job that failed in a worker.
+	 */
+	Job* next()
+	    {
+	    Job* job=NULL;
+	    ::pthread_mutex_lock(&mutex);
+	    if(next_out< next_in)
+		{
+		map<size_t,Job*>::iterator r;
+		while((r=done.find(next_out))==done.end())
+		    {
+		    ::pthread_cond_wait(&cond_done,&mutex);
+		    }
+		job=r->second;
+		done.erase(r);
+		++next_out;
+		}
+	    ::pthread_mutex_unlock(&mutex);
+	    if(job!=NULL && !job->error.empty())
+		{
+		string msg;
+		msg.swap(job->error);
+		release(job);
+		throw runtime_error(msg);
+		}
+	    return job;
+	    }
+    };
+
+/** a table of the command line */
+struct Source
+    {
+    enum Type { mysql_table, dump_file, local_file } type;
+    /* name of the mysql table or path of the file */
+    const char* path;
+    string name;
+    /* .sql schema of a dump */
+    const char* sql;
+    vector<string> fields;
     };
 
 class MysqlUcsc
     {
     public:
 	 MYSQL* mysql;
-	 Table* table;
+	 string host;
+	 string username;
+	 string password;
+	 string database;
+	 int port;
+	 vector<Table*> tables;
+	 Annotator* annotator;
+	 WorkerPool* pool;
+	 /* annotators whose data are shared by the annotators of the pool */
+	 vector<Annotator*> shared;
+	 vector<LocalFile*> files;
+	 vector<MYSQL*> connections;
+	 Cache* cache;
+	 /* for each table */
+	 vector<string> cache_versions;
+	 BufferedWriter out;
+	 /* several tables: one row per hit tagged with the name of the table */
+	 bool tagged;
 	 char delim;
 	 bool first_line_header;
 	 int chromcol;
@@ -120,14 +1748,24 @@ class MysqlUcsc
 	 int limit;
 	 bool data_are_plus1_based;
 	 int select_type;
+	 size_t batch_size;
 	 MysqlUcsc():
 		 mysql(NULL),
-		 table(NULL),
+		 host("genome-mysql.cse.ucsc.edu"),
+		 username("genome"),
+		 database("hg19"),
+		 port(0),
+		 annotator(NULL),
+		 pool(NULL),
+		 cache(NULL),
+		 out(stdout),
+		 tagged(false),
 		 delim('\t'),
 		 first_line_header(true),
 		 limit(-1),
 		 data_are_plus1_based(false),
-		 select_type(select_any)
+		 select_type(select_any),
+		 batch_size(1)
 	     {
 	     chromcol=-1;
 	     startcol=-1;
@@ -137,118 +1775,405 @@ class MysqlUcsc
 
 
 
-	 ~MysqlUcsc()
+	 ~MysqlUcsc()
+	     {
+	     if(pool!=NULL) delete pool;
+	     if(annotator!=NULL) delete annotator;
+	     for(size_t i=0;i< shared.size();++i) delete shared[i];
+	     for(size_t i=0;i< files.size();++i) delete files[i];
+	     for(size_t i=0;i< connections.size();++i) ::mysql_close(connections[i]);
+	     if(cache!=NULL) delete cache;
+	     for(size_t i=0;i< tables.size();++i) delete tables[i];
+	     ::mysql_close(mysql);
+	     }
+
+	 /** connects 'c' (a new connection if NULL) to the server */
+	 MYSQL* connect(MYSQL* c)
+	     {
+	     if(c==NULL)
+		 {
+		 c=::mysql_init(NULL);
+		 if(c==NULL) THROW("Cannot init mysql");
+		 connections.push_back(c);
+		 }
+	     if(mysql_real_connect(
+		     c,
+		     host.c_str(),
+		     username.c_str(),
+		     password.c_str(),
+		     database.c_str(), port,NULL, 0 )==NULL)
+		 {
+		 THROW("mysql_real_connect failed.");
+		 }
+	     return c;
+	     }
+
+	 Table* schema(const char* tableName)
+	     {
+	     Table* table=new Table;
+	     table->name.assign(tableName);
+	     MYSQL_ROW row;
+	     ostringstream os;
+	     os << "desc "<< tableName;
+	     string query=os.str();
+	     mysql_real_query( mysql, query.c_str(),query.size());
+	     MYSQL_RES* res=mysql_use_result( mysql );
+	     //int num_fields = mysql_num_fields(res);
+	     while(( row = mysql_fetch_row( res ))!=NULL )
+		     {
+		     unsigned long *lengths= mysql_fetch_lengths(res);
+		     if(lengths==NULL) THROW("cannot fetch length");
+		     string colName(row[0],lengths[0]);
+		     table->add(colName);
+		     }
+	     mysql_free_result( res );
+	     if(!table->validate())
+		 {
+		 delete table;
+		 return 0;
+		 }
+	     return table;
+	     }
+
+	 /** schema saved in the cache by a previous run, see cacheSchema */
+	 Table* schema(Cache* cache,const string& key,const char* tableName)
+	     {
+	     string data;
+	     vector<string> header;
+	     if(!cache->get(key,data))
+		 {
+		 cerr << "Schema of "<< tableName << " is not in cache" << endl;
+		 return 0;
+		 }
+	     split(data,'\t',header);
+	     Table* table=new Table;
+	     table->name.assign(tableName);
+	     for(size_t i=0;i< header.size();++i)
+		 {
+		 table->add(header[i]);
+		 }
+	     if(!table->validate())
+		 {
+		 delete table;
+		 return 0;
+		 }
+	     return table;
+	     }
+
+	 void cacheSchema(const string& key,const Table* table)
+	     {
+	     string data;
+	     for(size_t i=0;i< table->columns.size();++i)
+		 {
+		 if(i>0) data+='\t';
+		 data.append(table->columns[i]);
+		 }
+	     cache->put(key,data);
+	     }
+
+	 /** hash of everything but the record defining the result of a query: the keys of the cache start with it */
+	 string version(const string& schema_key,const Table* table,const vector<string>& schema_columns)
+	     {
+	     ostringstream os;
+	     os << schema_key << '\n';
+	     for(size_t i=0;i< schema_columns.size();++i) os << schema_columns[i] << '\t';
+	     os << '\n';
+	     for(size_t i=0;i< table->columns.size();++i) os << table->columns[i] << '\t';
+	     os << '\n' << select_type << '\n' << limit << '\n' << delim;
+	     string s(os.str());
+	     /* FNV-1a */
+	     uint64_t h=14695981039346656037ULL;
+	     for(size_t i=0;i< s.size();++i)
+		 {
+		 h^=(unsigned char)s[i];
+		 h*=1099511628211ULL;
+		 }
+	     ostringstream hex;
+	     hex << std::hex << h;
+	     return hex.str();
+	     }
+
+	 /** annotator sending the queries for tables[t] to 'mysql', behind the cache if any */
+	 Annotator* sqlAnnotator(MYSQL* mysql,size_t t)
+	     {
+	     Table* table=tables[t];
+	     Annotator* a;
+	     if(batch_size>1)
+		 {
+		 a=new BatchSqlAnnotator(mysql,table,select_type,limit,delim);
+		 }
+	     else
+		 {
+		 a=new SqlAnnotator(mysql,table,select_type,limit,delim);
+		 }
+	     if(cache!=NULL)
+		 {
+		 a=new CachedAnnotator(a,cache,cache_versions[t],table,select_type,limit,delim);
+		 }
+	     return a;
+	     }
+
+	 /** one annotator per table */
+	 static Annotator* combine(const vector<Annotator*>& annotators)
+	     {
+	     if(annotators.size()==1) return annotators[0];
+	     return new MultiAnnotator(annotators);
+	     }
+
+	 /** loads the table dump of 'src' in memory, the columns of the rows are joined with 'rowDelim' */
+	 IndexAnnotator* dump(const Source& src,char rowDelim)
+	     {
+	     gzFile in=gzopen(src.path,"r");
+	     if(in==NULL)
+		 {
+		 cerr << "Cannot open "<< src.path << " " << strerror(errno) << endl;
+		 return 0;
+		 }
+	     Table* table=(src.sql==NULL?schema(in,src.name.c_str()):schema(src.sql,src.name.c_str()));
+	     if(table==NULL)
+		 {
+		 cerr << "Cannot get table "<< src.path << endl;
+		 gzclose(in);
+		 return 0;
+		 }
+	     tables.push_back(table);
+	     vector<string> header(table->columns);
+	     if(!src.fields.empty()) table->columns=src.fields;
+	     IndexAnnotator* annotator=new IndexAnnotator(table,select_type,limit,rowDelim);
+	     annotator->load(in,header);
+	     gzclose(in);
+	     return annotator;
+	     }
+
+	 /** schema of a UCSC table dump: its first line is '#' followed by the column names */
+	 Table* schema(gzFile in,const char* tableName)
 	     {
-	     if(table!=NULL) delete table;
-	     ::mysql_close(mysql);
+	     string line;
+	     vector<string> header;
+	     if(!readline(in,line) || line.empty() || line[0]!='#')
+		 {
+		 cerr << "Expected a header starting with '#' in "<< tableName << endl;
+		 return 0;
+		 }
+	     split(line.substr(1),'\t',header);
+	     Table* table=new Table;
+	     table->name.assign(tableName);
+	     for(size_t i=0;i< header.size();++i)
+		 {
+		 table->add(header[i]);
+		 }
+	     if(!table->validate())
+		 {
+		 delete table;
+		 return 0;
+		 }
+	     return table;
 	     }
 
-	 void split(const string& line,vector<string>& tokens)
-		{
-		size_t prev=0;
-		size_t i=0;
-		tokens.clear();
-		while(i<=line.size())
-		    {
-		    if(i==line.size() || line[i]==delim)
-			{
-			tokens.push_back(line.substr(prev,i-prev));
-			if(i==line.size()) break;
-			prev=i+1;
-			}
-		    ++i;
-		    }
-		}
-
-	 Table* schema(const char* tableName)
+	 /**
+	  * schema of a header-less UCSC table dump from its .sql file:
+	  * the column names are the backquoted names starting a line of the
+	  * 'CREATE TABLE' statement
+	  */
+	 Table* schema(const char* sqlFile,const char* tableName)
 	     {
+	     gzFile in=gzopen(sqlFile,"r");
+	     if(in==NULL)
+		 {
+		 cerr << "Cannot open "<< sqlFile << " " << strerror(errno) << endl;
+		 return 0;
+		 }
+	     string line;
+	     bool in_create=false;
 	     Table* table=new Table;
-	     table->hasBin=false;
 	     table->name.assign(tableName);
-	     MYSQL_ROW row;
-	     ostringstream os;
-	     os << "desc "<< tableName;
-	     string query=os.str();
-	     mysql_real_query( mysql, query.c_str(),query.size());
-	     MYSQL_RES*	res=mysql_use_result( mysql );
-	     //int num_fields = mysql_num_fields(res);
-	     while(( row = mysql_fetch_row( res ))!=NULL )
+	     while(readline(in,line))
+		 {
+		 if(line.compare(0,12,"CREATE TABLE")==0)
 		     {
-		     unsigned long *lengths= mysql_fetch_lengths(res);
-		     if(lengths==NULL) THROW("cannot fetch length");
-		     string colName(row[0],lengths[0]);
-		     table->columns.push_back(colName);
-		     if(colName.compare("bin")==0)
-			 {
-			 table->hasBin=true;
-			 }
-		     else if(colName.compare("chrom")==0)
+		     in_create=true;
+		     continue;
+		     }
+		 if(!in_create) continue;
+		 size_t i=line.find_first_not_of(" \t");
+		 if(i==string::npos) continue;
+		 if(line[i]==')') break;
+		 if(line[i]!='`') continue;
+		 size_t j=line.find('`',i+1);
+		 if(j==string::npos) continue;
+		 table->add(line.substr(i+1,j-i-1));
+		 }
+	     gzclose(in);
+	     if(!table->validate())
+		 {
+		 delete table;
+		 return 0;
+		 }
+	     return table;
+	     }
+
+	 /** empty columns of tables[t] */
+	 void pad(size_t t)
+	     {
+	     for(size_t i=0;i< tables[t]->columns.size();++i)
+		 {
+		 out.write(delim);
+		 }
+	     }
+
+	 /**
+	  * several tables, grouped: the n-th line of a record holds the n-th
+	  * hit of each table, tagged: one line per hit with the name of its table
+	  */
+	 void printGroups(const Record* rec)
+	     {
+	     size_t n=0;
+	     for(size_t t=0;t< rec->groups.size();++t)
+		 {
+		 n=max(n,rec->groups[t].size());
+		 }
+	     if(tagged)
+		 {
+		 for(size_t t=0;t< rec->groups.size();++t)
+		     {
+		     for(size_t j=0;j< rec->groups[t].size();++j)
 			 {
-			 table->chrom=colName;
+			 out.write(rec->line);
+			 out.write(delim);
+			 out.write(tables[t]->name);
+			 out.write(delim);
+			 out.write(rec->groups[t][j]);
+			 out.write('\n');
 			 }
-		     else if(colName.compare("chromStart")==0)
+		     }
+		 if(n==0)
+		     {
+		     out.write(rec->line);
+		     out.write(delim);
+		     out.write('\n');
+		     }
+		 return;
+		 }
+	     for(size_t j=0;j< max(n,(size_t)1);++j)
+		 {
+		 out.write(rec->line);
+		 for(size_t t=0;t< rec->groups.size();++t)
+		     {
+		     if(j< rec->groups[t].size())
 			 {
-			 table->chromStart=colName;
+			 out.write(delim);
+			 out.write(rec->groups[t][j]);
 			 }
-		     else if(colName.compare("chromEnd")==0)
+		     else
 			 {
-			 table->chromEnd=colName;
+			 pad(t);
 			 }
 		     }
-	     mysql_free_result( res );
-	     if(table->chrom.empty())
+		 out.write('\n');
+		 }
+	     }
+
+	 void print(const Record* rec)
+	     {
+	     if(tables.size()>1)
 		 {
-		 cerr << "Cannot find chrom column in "<< tableName << endl;
-		 delete table;
-		 return 0;
+		 printGroups(rec);
+		 return;
 		 }
-	     if(table->chromStart.empty())
+	     if(rec->hits.empty())
 		 {
-		 cerr << "Cannot find chromStart column in "<< tableName << endl;
-		 delete table;
-		 return 0;
+		 out.write(rec->line);
+		 for(size_t i=0;i< tables[0]->columns.size();++i)
+		     {
+		     out.write(delim);
+		     }
+		 out.write('\n');
+		 return;
 		 }
-	     if(table->chromEnd.empty())
+	     for(size_t j=0;j< rec->hits.size();++j)
 		 {
-		 cerr << "Cannot find chromEnd column in "<< tableName << endl;
-		 delete table;
-		 return 0;
+		 out.write(rec->line);
+		 out.write(delim);
+		 out.write(rec->hits[j]);
+		 out.write('\n');
+		 }
+	     }
+
+	 void print(Job* job)
+	     {
+	     for(size_t i=0;i< job->batch.size();++i)
+		 {
+		 if(job->batch[i]->skip) continue;
+		 print(job->batch[i]);
+		 }
+	     job->batch.clear();
+	     }
+
+	 /** a job ready to be filled with records: printing the pending jobs if needed */
+	 Job* acquire(Job* single)
+	     {
+	     if(pool==NULL) return single;
+	     Job* job=pool->take();
+	     if(job==NULL)
+		 {
+		 job=pool->next();
+		 if(job==NULL) THROW("No job available in the pool");
+		 print(job);
+		 }
+	     return job;
+	     }
+
+	 void submit(Job* job)
+	     {
+	     if(pool==NULL)
+		 {
+		 annotator->annotate(job->batch);
+		 print(job);
+		 }
+	     else
+		 {
+		 pool->submit(job);
 		 }
-	     return table;
 	     }
 
 	 void run(std::istream& in)
 	     {
 	     string line;
-	     vector<int> binList;
 	     size_t nLine=0;
-	     vector<string> tokens;
-	     ostringstream os;
-	     os << "select ";
-	     for(size_t i=0;i<  table->columns.size();++i)
-		 {
-		 if(i>0) os << ",";
-		 os << table->columns[i];
-		 }
-	     os << " from "<< table->name << " where chrom=\"" ;
-	     const string base_query(os.str());
+	     Job single(batch_size);
+	     Job* job=acquire(&single);
 
 	     while(getline(in,line,'\n'))
 		 {
 		 ++nLine;
-		 split(line,tokens);
+		 Record& rec=job->records[job->batch.size()];
+		 vector<string>& tokens=rec.tokens;
+		 split(line,delim,tokens);
 		 if(nLine==1 && first_line_header)
 		     {
-		     for(size_t i=0;i< tokens.size();++i)
+		     out.write(line);
+		     if(tables.size()>1 && tagged)
 			 {
-			 if(i>0) cout << delim;
-			 cout << tokens[i];
+			 out.write(delim);
+			 out.write("table");
 			 }
-		     for(size_t i=0;i< table->columns.size();++i)
+		     else
 			 {
-			 cout << delim<< table->columns[i];
+			 for(size_t t=0;t< tables.size();++t)
+			     {
+			     for(size_t i=0;i< tables[t]->columns.size();++i)
+				 {
+				 out.write(delim);
+				 if(tables.size()>1)
+				     {
+				     out.write(tables[t]->name);
+				     out.write('.');
+				     }
+				 out.write(tables[t]->columns[i]);
+				 }
+			     }
 			 }
-		     cout <<endl;
+		     out.write('\n');
 		     continue;
 		     }
 		 if((size_t)chromcol>=tokens.size())
@@ -280,113 +2205,64 @@ class MysqlUcsc
 		     cerr << "Bad chromStart in "<< line << endl;
 		     continue;
 		     }
+		 rec.chrom.assign(tokens[chromcol]);
+		 rec.chromStart=chromStart;
+		 rec.chromEnd=chromEnd;
 		 if(data_are_plus1_based)
 		     {
 		     chromStart--;
 		     chromEnd--;
 		     }
-
-		 ostringstream sql;
-		 sql << base_query;
-		 sql << tokens[chromcol] << "\" and ";
-		 switch(select_type)
-		     {
-		     case select_user_IN_sql:
-			 {
-			 sql << table->chromStart << " <= " << tokens[startcol]
-			    << " and "<< table->chromEnd << " >= " << tokens[endcol];
-
-			 break;
-			 }
-		     case select_user_OUT_sql:
-			 {
-			 sql << table->chromStart << " >= " << tokens[startcol]
-			    << " and "<< table->chromEnd << " <= " << tokens[endcol]
-			     ;
-			 break;
-			 }
-		     default:
-			 {
-			 sql << " NOT(" << table->chromEnd << " <= " << tokens[startcol]
-			    << " or "<< table->chromStart << " > " << tokens[endcol]
-			    << ")";
-			 break;
-			 }
-		     }
-		 if(table->hasBin)
-		     {
-		     binList.clear();
-		     bins(chromStart,chromEnd,binList);
-		     sql << " and bin in (";
-		     for(size_t i=0;i< binList.size();++i)
-			 {
-			 if(i>0) sql << ",";
-			 sql << binList[i];
-			 }
-		     sql << ")";
-		     }
-		  if(limit>0)
-		     {
-		     sql << " limit "<< limit;
-		     }
-		 bool found=false;
-		 string query(sql.str());
-
-		 MYSQL_ROW row;
-		 if(mysql_real_query( mysql, query.c_str(),query.size())!=0)
-		     {
-		     cerr << "Failure for "<< query << "\n";
-		     cerr << mysql_error(mysql)<< endl;
-		     continue;
-		     }
-		 MYSQL_RES* res=mysql_use_result( mysql );
-		 int ncols=mysql_field_count(mysql);
-		 while(( row = mysql_fetch_row( res ))!=NULL )
-			 {
-			 for(size_t i=0;i< tokens.size();++i)
-			     {
-			     if(i>0) cout << delim;
-			     cout << tokens[i];
-			     }
-			 for(int i=0;i< ncols;++i)
-			     {
-			     cout << delim << row[i];
-			     }
-			 cout << endl;
-			 found=true;
-			 }
-		 ::mysql_free_result( res );
-
-		 if(!found)
+		 rec.binStart=chromStart;
+		 rec.binEnd=chromEnd;
+		 rec.line.swap(line);
+		 rec.hits.clear();
+		 rec.skip=false;
+		 job->batch.push_back(&rec);
+		 if(job->batch.size()==batch_size)
 		     {
-		     for(size_t i=0;i< tokens.size();++i)
-			 {
-			 if(i>0) cout << delim;
-			 cout << tokens[i];
-			 }
-		     for(size_t i=0;i< table->columns.size();++i)
-			 {
-			 cout << delim ;
-			 }
-		     cout << endl;
+		     submit(job);
+		     job=acquire(&single);
 		     }
-
+		 }
+	     if(!job->batch.empty()) submit(job);
+	     else if(pool!=NULL) pool->release(job);
+	     /* pending jobs in the pool */
+	     while(pool!=NULL && (job=pool->next())!=NULL)
+		 {
+		 print(job);
+		 pool->release(job);
 		 }
 	     }
 
     };
 
+/** name of the table in a dump or a local file: its basename without extension */
+static string fileTableName(const char* path)
+    {
+    string s(path);
+    size_t i=s.rfind('/');
+    if(i!=string::npos) s.erase(0,i+1);
+    i=s.find('.');
+    if(i!=string::npos && i>0) s.erase(i);
+    return s;
+    }
+
 int main(int argc,char** argv)
     {
     MysqlUcsc app;
     int optind=1;
-    string host("genome-mysql.cse.ucsc.edu");
-    string username("genome");
-    string password;
-    string database("hg19");
+    /* --field before any table */
     vector<string> custom_fields;
-    char* tablename=NULL;
-    int port=0;
+    vector<Source> sources;
+    char* savefile=NULL;
+    bool preload=false;
+    bool sorted=false;
+    int nthreads=1;
+    char* cache_file=NULL;
+    bool cache_only=false;
+    long cache_ttl=-1;
+    long cache_max=-1;
     while(optind < argc)
 	    {
 	    if(std::strcmp(argv[optind],"-h")==0)
@@ -395,20 +2271,37 @@ int main(int argc,char** argv)
 		    cerr << "Compilation: "<<__DATE__<<"  at "<< __TIME__<<".\n";
 		    cerr << "Options:\n";
 		    cerr << "  --delim (char) delimiter default:tab\n";
-		    cerr << "  --host mysql host ( " << host << ")\n";
-		    cerr << "  --user mysql user ( " << username << ")\n";
-		    cerr << "  --password mysql password ( " << password << ")\n";
-		    cerr << "  --database mysql db ( " << database << ")\n";
+		    cerr << "  --host mysql host ( " << app.host << ")\n";
+		    cerr << "  --user mysql user ( " << app.username << ")\n";
+		    cerr << "  --password mysql password ( " << app.password << ")\n";
+		    cerr << "  --database mysql db ( " << app.database << ")\n";
 		    cerr << "  --port (int) mysql port ( default)\n";
-		    cerr << "  --table or -T (string)\n";
+		    cerr << "  --table or -T (string) Can be used several times, with --dump and --local.\n";
 		    cerr << "  -C (int) chromosome column (first is 1).\n";
 		    cerr << "  -S (int)start column (first is 1).\n";
 		    cerr << "  -E (int) end column (first is 1).\n";
 		    cerr << "  -f first column is not header.\n";
 		    cerr << "  -1 data are +1 based.\n";
 		    cerr << "  --limit (int) limit number or rows returned\n";
-		    cerr << "  --field <string> set custom field. Can be used several times\n";
+		    cerr << "  --field <string> set custom field of the previous table (of all the tables if first). Can be used several times\n";
 		    cerr << "  --type (int) type of selection: 0 any (default), 1 user data IN mysql data,2 user data embrace mysql data.\n";
+		    cerr << "  --batch (int) number of rows sent in one query (default 1).\n";
+		    cerr << "  --threads (int) number of parallel connections running the queries (default 1).\n";
+		    cerr << "  --cache (file) sqlite file caching the results of the queries.\n";
+		    cerr << "  --cache-ttl (int) ignore the cached results older than this number of seconds.\n";
+		    cerr << "  --cache-max (int) max number of results kept in the cache.\n";
+		    cerr << "  --cache-only don't connect to mysql: answer from the cache only.\n";
+		    cerr << "  --preload load the whole table in memory once instead of one query per row.\n";
+		    cerr << "  --sorted input is sorted on chrom/start: one ordered query per chromosome is merged with the input.\n";
+		    cerr << "  --dump (file) load the table in memory from a local UCSC dump (txt or txt.gz,\n"
+			    "     first line is '#' + column names). No mysql connection is made. The table\n"
+			    "     is named after the file. Can be used several times.\n";
+		    cerr << "  --schema (file) after --dump: the dump has no header, read the columns from the UCSC .sql file.\n";
+		    cerr << "  --save (file) with one --dump: write the table in a binary indexed file and exit.\n";
+		    cerr << "  --local (file) answer from a file written by --save (memory-mapped). No mysql connection is made.\n"
+			    "     Can be used several times.\n";
+		    cerr << "  --tagged several tables: one row per hit, the name of the table before its columns.\n"
+			    "     Default is one column group per table, the n-th row of a record holding the n-th hit of each table.\n";
 		    cerr << "(stdin|files)\n\n";
 		    exit(EXIT_FAILURE);
 		    }
@@ -424,7 +2317,14 @@ int main(int argc,char** argv)
 		}
 	    else if(std::strcmp(argv[optind],"--field")==0 && optind+1<argc)
 		{
-		custom_fields.push_back(argv[++optind]);
+		if(sources.empty())
+		    {
+		    custom_fields.push_back(argv[++optind]);
+		    }
+		else
+		    {
+		    sources.back().fields.push_back(argv[++optind]);
+		    }
 		}
 	    else if(std::strcmp(argv[optind],"-1")==0 && optind+1<argc)
 		{
@@ -479,23 +2379,120 @@ int main(int argc,char** argv)
 		}
 	    else if((std::strcmp(argv[optind],"--table")==0 || std::strcmp(argv[optind],"-T")==0) && optind+1<argc)
 		{
-		tablename=(argv[++optind]);
+		Source src;
+		src.type=Source::mysql_table;
+		src.path=argv[++optind];
+		src.name.assign(src.path);
+		src.sql=NULL;
+		sources.push_back(src);
+		}
+	    else if(std::strcmp(argv[optind],"--preload")==0)
+		{
+		preload=true;
+		}
+	    else if(std::strcmp(argv[optind],"--batch")==0 && optind+1<argc)
+		{
+		char* p2;
+		int n=(int)strtol(argv[++optind],&p2,10);
+		if(n<1 || *p2!=0)
+		    {
+		    cerr << "Bad batch size\n";
+		    return EXIT_FAILURE;
+		    }
+		app.batch_size=(size_t)n;
+		}
+	    else if(std::strcmp(argv[optind],"--threads")==0 && optind+1<argc)
+		{
+		char* p2;
+		nthreads=(int)strtol(argv[++optind],&p2,10);
+		if(nthreads<1 || *p2!=0)
+		    {
+		    cerr << "Bad number of threads\n";
+		    return EXIT_FAILURE;
+		    }
+		}
+	    else if(std::strcmp(argv[optind],"--cache")==0 && optind+1<argc)
+		{
+		cache_file=argv[++optind];
+		}
+	    else if(std::strcmp(argv[optind],"--cache-only")==0)
+		{
+		cache_only=true;
+		}
+	    else if(std::strcmp(argv[optind],"--cache-ttl")==0 && optind+1<argc)
+		{
+		char* p2;
+		cache_ttl=strtol(argv[++optind],&p2,10);
+		if(cache_ttl<1 || *p2!=0)
+		    {
+		    cerr << "Bad cache ttl\n";
+		    return EXIT_FAILURE;
+		    }
+		}
+	    else if(std::strcmp(argv[optind],"--cache-max")==0 && optind+1<argc)
+		{
+		char* p2;
+		cache_max=strtol(argv[++optind],&p2,10);
+		if(cache_max<1 || *p2!=0)
+		    {
+		    cerr << "Bad cache max\n";
+		    return EXIT_FAILURE;
+		    }
+		}
+	    else if(std::strcmp(argv[optind],"--sorted")==0)
+		{
+		sorted=true;
+		}
+	    else if(std::strcmp(argv[optind],"--dump")==0 && optind+1<argc)
+		{
+		Source src;
+		src.type=Source::dump_file;
+		src.path=argv[++optind];
+		src.name=fileTableName(src.path);
+		src.sql=NULL;
+		sources.push_back(src);
+		}
+	    else if(std::strcmp(argv[optind],"--schema")==0 && optind+1<argc)
+		{
+		if(sources.empty() || sources.back().type!=Source::dump_file)
+		    {
+		    cerr << "--schema must follow --dump\n";
+		    return EXIT_FAILURE;
+		    }
+		sources.back().sql=argv[++optind];
+		}
+	    else if(std::strcmp(argv[optind],"--save")==0 && optind+1<argc)
+		{
+		savefile=(argv[++optind]);
+		}
+	    else if(std::strcmp(argv[optind],"--local")==0 && optind+1<argc)
+		{
+		Source src;
+		src.type=Source::local_file;
+		src.path=argv[++optind];
+		src.name=fileTableName(src.path);
+		src.sql=NULL;
+		sources.push_back(src);
+		}
+	    else if(std::strcmp(argv[optind],"--tagged")==0)
+		{
+		app.tagged=true;
 		}
 	    else if(std::strcmp(argv[optind],"--host")==0 && optind+1<argc)
 		{
-		host.assign(argv[++optind]);
+		app.host.assign(argv[++optind]);
 		}
 	    else if(std::strcmp(argv[optind],"--user")==0 && optind+1<argc)
 		{
-		username.assign(argv[++optind]);
+		app.username.assign(argv[++optind]);
 		}
 	    else if(std::strcmp(argv[optind],"--password")==0 && optind+1<argc)
 		{
-		password.assign(argv[++optind]);
+		app.password.assign(argv[++optind]);
 		}
 	    else if(std::strcmp(argv[optind],"--port")==0 && optind+1<argc)
 		{
-		port=atoi(argv[++optind]);
+		app.port=atoi(argv[++optind]);
 		}
 	    else if(std::strcmp(argv[optind],"--delim")==0 && optind+1< argc)
 		{
@@ -519,63 +2516,184 @@ int main(int argc,char** argv)
 	    ++optind;
 	       }
 
-    if(tablename==NULL)
-	{
-	cerr << "undefined table" << endl;
-	return EXIT_FAILURE;
-	}
-    if(app.chromcol<0)
-    	{
-    	cerr << "undefined CHROM col"<< endl;
-    	return EXIT_FAILURE;
-    	}
-    if(app.startcol<0)
+    try
 	{
-	cerr << "undefined START col"<< endl;
-	return EXIT_FAILURE;
-	}
-    if(app.endcol<0) app.endcol=app.startcol;
-    if(mysql_real_connect(
-	    app. mysql,
-	    host.c_str(),
-	    username.c_str(),
-	    password.c_str(),
-	    database.c_str(), port,NULL, 0 )==NULL)
-	{
-	THROW("mysql_real_connect failed.");
-	}
-    app.table=app.schema(tablename);
-    if(!custom_fields.empty())
-	{
-	app.table->columns.clear();
-	for(size_t i=0;i< custom_fields.size();++i)
+	for(size_t t=0;t< sources.size();++t)
 	    {
-	    app.table->columns.push_back(custom_fields[i]);
+	    if(sources[t].fields.empty()) sources[t].fields=custom_fields;
 	    }
-	}
-    if(app.table==NULL)
-	{
-	cerr << "Cannot get table "<< database<<"."<< tablename << endl;
-	return EXIT_FAILURE;
-	}
-    if(optind==argc)
+	if(savefile!=NULL)
+	    {
+	    if(sources.size()!=1 || sources[0].type!=Source::dump_file)
+		{
+		cerr << "--save requires one --dump" << endl;
+		return EXIT_FAILURE;
+		}
+	    /* the rows are saved tab delimited */
+	    IndexAnnotator* annotator=app.dump(sources[0],'\t');
+	    if(annotator==NULL) return EXIT_FAILURE;
+	    annotator->save(savefile);
+	    delete annotator;
+	    return EXIT_SUCCESS;
+	    }
+	if(sources.empty())
+	    {
+	    cerr << "undefined table" << endl;
+	    return EXIT_FAILURE;
+	    }
+	if(app.chromcol<0)
+	    {
+	    cerr << "undefined CHROM col"<< endl;
+	    return EXIT_FAILURE;
+	    }
+	if(app.startcol<0)
+	    {
+	    cerr << "undefined START col"<< endl;
+	    return EXIT_FAILURE;
+	    }
+	if(app.endcol<0) app.endcol=app.startcol;
+	bool use_mysql=false;
+	for(size_t t=0;t< sources.size();++t)
+	    {
+	    if(sources[t].type==Source::mysql_table) use_mysql=true;
+	    }
+	if(use_mysql)
 	    {
-	    app.run(cin);
+	    if(cache_file!=NULL)
+		{
+		app.cache=new Cache;
+		app.cache->ttl=cache_ttl;
+		app.cache->max_entries=cache_max;
+		if(app.cache->open(cache_file)!=EXIT_SUCCESS) return EXIT_FAILURE;
+		}
+	    else if(cache_only)
+		{
+		cerr << "--cache-only requires --cache" << endl;
+		return EXIT_FAILURE;
+		}
+	    if(!cache_only) app.connect(app.mysql);
 	    }
-    else
+	/* the sql annotators are created for each connection of the pool */
+	bool pooled=(nthreads>1 && !preload && !sorted && !cache_only);
+	/* the streamed queries of the sweeps need one connection per table */
+	bool sweeping=false;
+	vector<Annotator*> annotators;
+	for(size_t t=0;t< sources.size();++t)
 	    {
-	    while(optind< argc)
+	    const Source& src=sources[t];
+	    Annotator* annotator=NULL;
+	    if(src.type==Source::local_file)
+		{
+		LocalFile* file=new LocalFile;
+		app.files.push_back(file);
+		if(file->open(src.path)!=EXIT_SUCCESS) return EXIT_FAILURE;
+		Table* table=new Table;
+		app.tables.push_back(table);
+		table->name=src.name;
+		table->columns=(src.fields.empty()?file->columns:src.fields);
+		table->chrom=file->chrom;
+		table->chromStart=file->chromStart;
+		table->chromEnd=file->chromEnd;
+		annotator=new LocalAnnotator(file,table,app.select_type,app.limit,app.delim);
+		}
+	    else if(src.type==Source::dump_file)
+		{
+		annotator=app.dump(src,app.delim);
+		if(annotator==NULL) return EXIT_FAILURE;
+		}
+	    else
 		{
-		char* filename=argv[optind++];
-		fstream in(filename,ios::in);
-		if(!in.is_open())
+		string schema_key("#schema\t"+app.host+"/"+app.database+"."+src.name);
+		Table* table;
+		if(cache_only)
+		    {
+		    table=app.schema(app.cache,schema_key,src.path);
+		    }
+		else
 		    {
-		    cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+		    table=app.schema(src.path);
+		    if(table!=NULL && app.cache!=NULL) app.cacheSchema(schema_key,table);
+		    }
+		if(table==NULL)
+		    {
+		    cerr << "Cannot get table "<< app.database<<"."<< src.name << endl;
 		    return EXIT_FAILURE;
 		    }
-		app.run(in);
-		in.close();
+		app.tables.push_back(table);
+		vector<string> schema_columns(table->columns);
+		if(!src.fields.empty()) table->columns=src.fields;
+		app.cache_versions.resize(app.tables.size());
+		if(app.cache!=NULL) app.cache_versions[t]=app.version(schema_key,table,schema_columns);
+		if(cache_only)
+		    {
+		    annotator=new CachedAnnotator(NULL,app.cache,app.cache_versions[t],table,app.select_type,app.limit,app.delim);
+		    }
+		else if(preload)
+		    {
+		    IndexAnnotator* index=new IndexAnnotator(table,app.select_type,app.limit,app.delim);
+		    index->load(app.mysql);
+		    annotator=index;
+		    }
+		else if(sorted)
+		    {
+		    annotator=new SweepAnnotator(sweeping?app.connect(NULL):app.mysql,table,app.select_type,app.limit,app.delim);
+		    sweeping=true;
+		    }
+		else if(!pooled)
+		    {
+		    annotator=app.sqlAnnotator(app.mysql,t);
+		    }
+		}
+	    annotators.push_back(annotator);
+	    }
+	app.cache_versions.resize(app.tables.size());
+	if(pooled)
+	    {
+	    vector<Annotator*> workers;
+	    for(int i=0;i< nthreads;++i)
+		{
+		MYSQL* mysql=(use_mysql?app.connect(NULL):NULL);
+		vector<Annotator*> v;
+		for(size_t t=0;t< annotators.size();++t)
+		    {
+		    v.push_back(annotators[t]==NULL?app.sqlAnnotator(mysql,t):annotators[t]->copy());
+		    }
+		workers.push_back(MysqlUcsc::combine(v));
 		}
+	    for(size_t t=0;t< annotators.size();++t)
+		{
+		if(annotators[t]!=NULL) app.shared.push_back(annotators[t]);
+		}
+	    app.pool=new WorkerPool(workers,app.batch_size);
+	    }
+	else
+	    {
+	    app.annotator=MysqlUcsc::combine(annotators);
 	    }
+	if(optind==argc)
+		{
+		app.run(cin);
+		}
+	else
+		{
+		while(optind< argc)
+		    {
+		    char* filename=argv[optind++];
+		    fstream in(filename,ios::in);
+		    if(!in.is_open())
+			{
+			cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+			return EXIT_FAILURE;
+			}
+		    app.run(in);
+		    in.close();
+		    }
+		}
+	}
+    catch(std::exception& err)
+	{
+	cerr << err.what() << endl;
+	return EXIT_FAILURE;
+	}
     return EXIT_SUCCESS;
     }
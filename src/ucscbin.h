@@ -0,0 +1,100 @@
+/**
+ * Author:
+ *	Pierre Lindenbaum PhD
+ * Contact:
+ *	plindenbaum@yahoo.fr
+ * WWW:
+ *	http://plindenbaum.blogspot.com
+ * Motivation:
+ *	UCSC binning scheme (see kent/src/lib/binRange.c). A feature is stored
+ *	in the smallest bin containing it. The bins overlapping a range are,
+ *	at each level, a range of consecutive bins, so a query only needs
+ *	'bin between a and b' for each level.
+ *	The standard scheme covers 512Mb, the extended scheme is used above:
+ *	a range crossing 512Mb needs the bins of both schemes.
+ */
+#ifndef UCSC_BIN_H
+#define UCSC_BIN_H
+#include <vector>
+#include <ostream>
+
+#define UCSC_BIN_FIRST_SHIFT 17
+#define UCSC_BIN_NEXT_SHIFT 3
+#define UCSC_BIN_MAXEND_512M (512*1024*1024)
+/* offset of the extended bins: the standard scheme uses bins 0-4680 */
+#define UCSC_BIN_OFFSET_OLD_TO_EXTENDED 4681
+/* maximum number of ranges returned by binRanges: 5 standard + 6 extended levels across 512Mb */
+#define UCSC_BIN_RANGES 11
+
+/** consecutive bins first..last (inclusive) */
+struct BinRange
+    {
+    int first;
+    int last;
+    };
+
+/** appends the bins of [start,end[ at each level of a scheme ('offsets' from the smallest bins to the root) */
+inline void binLevels(int start,int end,const int* offsets,int levels,int shift,std::vector<BinRange>& ranges)
+    {
+    int startBin=(start>>UCSC_BIN_FIRST_SHIFT);
+    int endBin=((end-1)>>UCSC_BIN_FIRST_SHIFT);
+    for(int i=0;i< levels;++i)
+	{
+	BinRange r;
+	r.first=startBin+offsets[i]+shift;
+	r.last=endBin+offsets[i]+shift;
+	ranges.push_back(r);
+	startBin>>=UCSC_BIN_NEXT_SHIFT;
+	endBin>>=UCSC_BIN_NEXT_SHIFT;
+	}
+    }
+
+/**
+ * bins overlapping the 0-based half-open range [start,end[ , one range per
+ * level from the smallest bins to the root (like hAddBinToQuery of kent).
+ */
+inline void binRanges(int start,int end,std::vector<BinRange>& ranges)
+    {
+    static const int standard[]={512+64+8+1, 64+8+1, 8+1, 1, 0};
+    static const int extended[]={4096+512+64+8+1, 512+64+8+1, 64+8+1, 8+1, 1, 0};
+    ranges.clear();
+    if(end<=start) end=start+1;
+    if(end<=UCSC_BIN_MAXEND_512M)
+	{
+	binLevels(start,end,standard,5,0,ranges);
+	/* the features longer than 512Mb are in the root of the extended scheme */
+	BinRange r;
+	r.first=r.last=UCSC_BIN_OFFSET_OLD_TO_EXTENDED;
+	ranges.push_back(r);
+	return;
+	}
+    /* the features of the first 512Mb may be in the standard bins */
+    if(start< UCSC_BIN_MAXEND_512M)
+	{
+	binLevels(start,UCSC_BIN_MAXEND_512M,standard,5,0,ranges);
+	}
+    binLevels(start,end,extended,6,UCSC_BIN_OFFSET_OLD_TO_EXTENDED,ranges);
+    }
+
+/** SQL clause '(bin=x or bin between y and z ...)' for the range [start,end[ */
+inline void binWhere(std::ostream& out,const char* binField,int start,int end)
+    {
+    std::vector<BinRange> ranges;
+    binRanges(start,end,ranges);
+    out << "(";
+    for(size_t i=0;i< ranges.size();++i)
+	{
+	if(i>0) out << " or ";
+	if(ranges[i].first==ranges[i].last)
+	    {
+	    out << binField << "=" << ranges[i].first;
+	    }
+	else
+	    {
+	    out << binField << " between " << ranges[i].first << " and " << ranges[i].last;
+	    }
+	}
+    out << ")";
+    }
+
+#endif
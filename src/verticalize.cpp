@@ -8,9 +8,11 @@
  * WWW:
  *	http://plindenbaum.blogspot.com
  * Motivation:
- *	verticalize a table
+ *	verticalize a table. --transpose: transposes a table larger than
+ *	the memory, the blocks of rows are transposed into temporary files
+ *	that are merged line by line.
  * Compilation:
- *	 g++ -o verticalize -Wall -O3 verticalize.cpp -lz
+ *	 g++ -o verticalize -Wall -O3 verticalize.cpp -lz -lpthread
  */
 #include <cstdlib>
 #include <vector>
@@ -30,9 +32,18 @@
 #include <algorithm>
 #include <cassert>
 #include <stdint.h>
+#include <unistd.h>
+#include "linereader.h"
+#include "lineindex.h"
+#include "bufferedwriter.h"
 
 using namespace std;
 
+/* columns transposed together: one output buffer per column of a tile */
+#define TRANSPOSE_TILE 64
+/* maximum number of temporary files merged at once */
+#define TRANSPOSE_FANIN 128
+
 
 class Verticalize
     {
@@ -40,108 +51,357 @@ class Verticalize
 
 	char delim;
 	bool first_line_is_header;
+	/* threads inflating a BGZF input */
+	int nthreads;
+	/* --rows and --key: the lines are found with the index of the file */
+	const LineIndex* index;
+	bool rows;
+	uint64_t row_start;
+	uint64_t row_end;
+	vector<string> keys;
+	vector<string> header;
+	vector<Field> tokens;
+	size_t len_word;
+	vector<string> prefixes;
+	/* --transpose: memory of the two blocks of rows, directory of the temporary files */
+	bool transposing;
+	size_t memory;
+	string tmpdir;
+
+	/* a temporary file: the transpose of 'rows' rows, one line per column */
+	struct Spill
+	    {
+	    FILE* file;
+	    size_t rows;
+	    };
 
 
 	Verticalize()
 	    {
 	    delim='\t';
 	    first_line_is_header=true;
+	    nthreads=1;
+	    index=NULL;
+	    rows=false;
+	    row_start=0;
+	    row_end=0;
+	    len_word=0;
+	    transposing=false;
+	    memory=256*1048576;
+	    const char* t=getenv("TMPDIR");
+	    tmpdir.assign(t==NULL?"/tmp":t);
 	    }
 	~Verticalize()
 	    {
 	    }
 
-	bool readline(gzFile in,std::string& line)
+	/** '$i<delim>name<padding><delim>' of the column i, built once */
+	const string& prefix(size_t i)
+	    {
+	    while(prefixes.size()<=i)
+		{
+		size_t n=prefixes.size();
+		ostringstream os;
+		os << "$" << (n+1) << delim;
+		if(first_line_is_header)
+		    {
+		    string name(n< header.size()?header[n]:string("???"));
+		    os << name;
+		    if(name.size()< len_word) os << string(len_word-name.size(),' ');
+		    os << delim;
+		    }
+		prefixes.push_back(os.str());
+		}
+	    return prefixes[i];
+	    }
+
+	/** prints the line 'nLine' (1-based, the header is the line 1) */
+	void print(const Field& line,size_t nLine,BufferedWriter& out)
 	    {
-	    line.clear();
-	    int c;
-	    if(gzeof(in)) return false;
-	    while((c=gzgetc(in))!=EOF && c!='\n')
+	    out.write(">>>",3);
+	    out.write(delim);
+	    out.write((long)nLine);
+	    out.write('\n');
+	    LineReader::split(line,delim,tokens);
+	    size_t n=tokens.size();
+	    if(first_line_is_header) n=max(n,header.size());
+	    for(size_t i=0;i< n;++i)
+		{
+		out.write(prefix(i));
+		if(i<tokens.size())
 		    {
-		    line+=(char)c;
+		    out.write(tokens[i].begin,tokens[i].length);
 		    }
-	    return true;
+		else
+		    {
+		    out.write("???",3);
+		    }
+		out.write('\n');
+		}
+	    out.write("<<<",3);
+	    out.write(delim);
+	    out.write((long)nLine);
+	    out.write("\n\n",2);
 	    }
-	void split(const string& line,vector<string>& tokens)
+
+	/** prints the rows asked by --rows, then by --key */
+	void runIndexed(BgzfReader& in,LineReader& reader,BufferedWriter& out)
 	    {
-	    size_t prev=0;
-	    size_t i=0;
-	    tokens.clear();
-	    while(i<=line.size())
+	    Field line;
+	    /* the row n is the line n, or n-1 without header */
+	    uint64_t shift=(first_line_is_header?0:1);
+	    if(rows && row_start-shift< index->size() && index->seek(in,reader,row_start-shift))
+		{
+		for(uint64_t i=row_start;i<=row_end && reader.next(line);++i)
+		    {
+		    print(line,i-shift+1,out);
+		    }
+		}
+	    vector<uint64_t> lines;
+	    for(size_t k=0;k< keys.size();++k)
 		{
-		if(i==line.size() || line[i]==delim)
+		index->find(keys[k],lines);
+		for(size_t i=0;i< lines.size();++i)
 		    {
-		    tokens.push_back(line.substr(prev,i-prev));
-		    if(i==line.size()) break;
-		    prev=i+1;
+		    if(lines[i]< 1-shift || !index->seek(in,reader,lines[i]) || !reader.next(line)) continue;
+		    const char* q=(const char*)memchr(line.begin,delim,line.length);
+		    Field key;
+		    key.begin=line.begin;
+		    key.length=(q==NULL?line.length:q-line.begin);
+		    if(!key.equals(keys[k])) continue;
+		    print(line,lines[i]+1,out);
 		    }
-		++i;
 		}
 	    }
 
+	/** a temporary file, deleted when it is closed */
+	Spill createSpill()
+	    {
+	    string path=tmpdir+"/verticalizeXXXXXX";
+	    vector<char> tmpl(path.begin(),path.end());
+	    tmpl.push_back(0);
+	    int fd=::mkstemp(&tmpl[0]);
+	    if(fd==-1) throw runtime_error("Cannot create a temporary file in "+tmpdir+": "+strerror(errno));
+	    ::unlink(&tmpl[0]);
+	    Spill spill;
+	    spill.file=::fdopen(fd,"w+b");
+	    spill.rows=0;
+	    if(spill.file==NULL) throw runtime_error("Cannot open a temporary file");
+	    return spill;
+	    }
 
-	void run(gzFile in)
+	/**
+	 * reads whole lines into 'block' (each one followed by '\n') and
+	 * their offsets into 'starts' until both reach 'size' bytes. False
+	 * at the end of the input.
+	 */
+	bool readBlock(LineReader& reader,string& block,vector<uint32_t>& starts,size_t size)
 	    {
-	    size_t nLine=0UL;
-	    vector<string> header;
-	    vector<string> tokens;
-	    string line;
-	    size_t len_word=0UL;
-	    if(first_line_is_header)
+	    Field line;
+	    block.clear();
+	    starts.clear();
+	    while(block.size()+starts.capacity()*sizeof(uint32_t)< size && reader.next(line))
+		{
+		if(block.size()+line.length>=(size_t)UINT32_MAX) throw runtime_error("Line too long for --transpose");
+		starts.push_back((uint32_t)block.size());
+		block.append(line.begin,line.length);
+		block+='\n';
+		}
+	    return !starts.empty();
+	    }
+
+	/**
+	 * writes the transpose of the lines of 'block'. The columns are
+	 * transposed by tiles: each row adds its fields to the buffers of the
+	 * columns of the tile. 'cursors' holds the offset of the next field of
+	 * each row, UINT32_MAX once its last field has been read: the fields
+	 * are never indexed all at once.
+	 */
+	size_t transposeBlock(const string& block,vector<uint32_t>& cursors,BufferedWriter& out)
+	    {
+	    const char* data=block.data();
+	    size_t nrows=cursors.size();
+	    vector<string> buffers(TRANSPOSE_TILE);
+	    for(size_t j0=0;;j0+=TRANSPOSE_TILE)
 		{
-		if(!readline(in,line))
+		/* number of columns of the tile found in at least one row */
+		size_t width=0;
+		for(size_t j=0;j< TRANSPOSE_TILE;++j) buffers[j].clear();
+		for(size_t i=0;i< nrows;++i)
 		    {
-		    cerr << "Error cannot read first line.\n";
-		    return;
+		    uint32_t& c=cursors[i];
+		    for(size_t j=0;j< TRANSPOSE_TILE;++j)
+			{
+			string& b=buffers[j];
+			if(i>0) b+=delim;
+			if(c==UINT32_MAX) continue;
+			const char* p=data+c;
+			const char* q=p;
+			while(*q!=delim && *q!='\n') ++q;
+			b.append(p,q-p);
+			width=max(width,j+1);
+			c=(*q=='\n'?UINT32_MAX:(uint32_t)(q+1-data));
+			}
 		    }
-		++nLine;
-		split(line,header);
-		for(size_t i=0;i< header.size();++i) len_word=max(len_word,header[i].size());
+		for(size_t j=0;j< width;++j)
+		    {
+		    out.write(buffers[j]);
+		    out.write('\n');
+		    }
+		if(width< TRANSPOSE_TILE) break;
 		}
+	    return nrows;
+	    }
 
-	    while(readline(in,line))
+	/** the line j of the output is made of the lines j of the temporary files, empty fields when a file is shorter */
+	void merge(vector<Spill>& spills,BufferedWriter& out)
+	    {
+	    vector<BgzfReader*> ins(spills.size());
+	    vector<LineReader*> readers(spills.size());
+	    vector<Field> lines(spills.size());
+	    vector<bool> done(spills.size(),false);
+	    for(size_t i=0;i< spills.size();++i)
 		{
-		++nLine;
-		cout << ">>>"<< delim << (nLine)<< endl;
-		split(line,tokens);
-		if(first_line_is_header)
+		if(std::fflush(spills[i].file)!=0 || std::fseek(spills[i].file,0L,SEEK_SET)!=0)
+		    {
+		    throw runtime_error("Cannot read a temporary file");
+		    }
+		ins[i]=new BgzfReader(spills[i].file);
+		readers[i]=new LineReader(*ins[i],65536);
+		}
+	    for(;;)
+		{
+		bool found=false;
+		for(size_t i=0;i< spills.size();++i)
+		    {
+		    if(!done[i] && !readers[i]->next(lines[i])) done[i]=true;
+		    if(!done[i]) found=true;
+		    }
+		if(!found) break;
+		for(size_t i=0;i< spills.size();++i)
 		    {
-		    for(size_t i=0;i< header.size();++i)
+		    if(i>0) out.write(delim);
+		    if(!done[i])
 			{
-			cout << "$"<<(i+1)<< delim << header[i];
-			for(size_t j=header[i].size();j< len_word;++j)
-			    {
-			    cout << " ";
-			    }
-			cout <<delim;
-			if(i<tokens.size())
-			    {
-			    cout << tokens[i];
-			    }
-			else
-			    {
-			    cout << "???";
-			    }
-			cout <<endl;
+			out.write(lines[i].begin,lines[i].length);
 			}
-		    for(size_t i=header.size();i< tokens.size();++i)
+		    else
 			{
-			cout << "$"<<(i+1)<<delim << "???";
-			for(size_t j=3;j< len_word;++j)
-			    {
-			    cout << " ";
-			    }
-			cout << delim << tokens[i] << endl;
+			for(size_t r=1;r< spills[i].rows;++r) out.write(delim);
 			}
 		    }
-		else
+		out.write('\n');
+		}
+	    for(size_t i=0;i< spills.size();++i)
+		{
+		delete readers[i];
+		delete ins[i];
+		std::fclose(spills[i].file);
+		}
+	    spills.clear();
+	    }
+
+	/**
+	 * out-of-core transpose: the blocks of rows are transposed into
+	 * temporary files, merged by groups of TRANSPOSE_FANIN until one merge
+	 * can write the output. A table held by one block is written directly.
+	 */
+	void transpose(BgzfReader& in)
+	    {
+	    LineReader reader(in);
+	    BufferedWriter out(stdout);
+	    vector<Spill> spills;
+	    /*
+	     * two blocks are read: the last one is not written to a temporary
+	     * file. The offsets of the lines are charged with the text, a block
+	     * is never larger than 2GB (32 bits offsets).
+	     */
+	    string block;
+	    string next;
+	    vector<uint32_t> starts;
+	    vector<uint32_t> next_starts;
+	    size_t size=max((size_t)1,min(memory/2,(size_t)INT32_MAX));
+	    block.reserve(size);
+	    next.reserve(size);
+	    readBlock(reader,block,starts,size);
+	    while(readBlock(reader,next,next_starts,size))
+		{
+		Spill spill=createSpill();
+		    {
+		    BufferedWriter w(spill.file);
+		    spill.rows=transposeBlock(block,starts,w);
+		    }
+		if(std::ferror(spill.file)) throw runtime_error("Cannot write a temporary file");
+		spills.push_back(spill);
+		block.swap(next);
+		starts.swap(next_starts);
+		}
+	    if(spills.empty())
+		{
+		transposeBlock(block,starts,out);
+		return;
+		}
+	    Spill last=createSpill();
+		{
+		BufferedWriter w(last.file);
+		last.rows=transposeBlock(block,starts,w);
+		}
+	    spills.push_back(last);
+	    while(spills.size()> TRANSPOSE_FANIN)
+		{
+		vector<Spill> merged;
+		for(size_t i=0;i< spills.size();i+=TRANSPOSE_FANIN)
 		    {
-		    for(size_t i=header.size();i< tokens.size();++i)
+		    vector<Spill> group(spills.begin()+i,spills.begin()+min(spills.size(),i+TRANSPOSE_FANIN));
+		    Spill spill=createSpill();
+		    for(size_t k=0;k< group.size();++k) spill.rows+=group[k].rows;
 			{
-			cout << "$"<<(i+1)<<delim << tokens[i] << endl;
+			BufferedWriter w(spill.file);
+			merge(group,w);
 			}
+		    if(std::ferror(spill.file)) throw runtime_error("Cannot write a temporary file");
+		    merged.push_back(spill);
+		    }
+		spills.swap(merged);
+		}
+	    merge(spills,out);
+	    }
+
+	void run(BgzfReader& in)
+	    {
+	    if(transposing)
+		{
+		transpose(in);
+		return;
+		}
+	    size_t nLine=0UL;
+	    LineReader reader(in);
+	    BufferedWriter out(stdout);
+	    Field line;
+	    header.clear();
+	    prefixes.clear();
+	    len_word=0UL;
+	    if(first_line_is_header)
+		{
+		if(!reader.next(line))
+		    {
+		    cerr << "Error cannot read first line.\n";
+		    return;
 		    }
-		cout << "<<<"<< delim << (nLine)<< "\n\n";
+		++nLine;
+		LineReader::split(line,delim,tokens);
+		for(size_t i=0;i< tokens.size();++i) header.push_back(tokens[i].str());
+		for(size_t i=0;i< header.size();++i) len_word=max(len_word,header[i].size());
+		}
+	    if(index!=NULL)
+		{
+		runIndexed(in,reader,out);
+		return;
+		}
+	    while(reader.next(line))
+		{
+		++nLine;
+		print(line,nLine,out);
 		}
 	    }
     };
@@ -153,6 +413,15 @@ void usage(const char* prg)
 	cerr << "Options:\n";
 	cerr << "  -d or --delim (char) delimiter default:tab\n";
 	cerr << "  -n first line is NOT the header.\n";
+	cerr << "  --threads (int) number of threads inflating a BGZF input (default 1).\n";
+	cerr << "  --rows A-B print the rows A to B (1-based, the header is not a row; 'A' or 'A-' are allowed)\n";
+	cerr << "  --key (string) print the rows whose first column is the key (can be called multiple time)\n";
+	cerr << "     --rows and --key use the index file.lidx, created if missing or out of date.\n"
+		"     The file must be plain or BGZF.\n";
+	cerr << "  --transpose print the transposed table instead: the line i is the column i of the input.\n"
+		"     The blocks of rows are transposed into temporary files, then merged.\n";
+	cerr << "  --memory (int) with --transpose: MB held by the blocks of rows, text and line offsets (default 256).\n";
+	cerr << "  --tmpdir (dir) with --transpose: directory of the temporary files (default $TMPDIR or /tmp).\n";
 	cerr << "(stdin|file|file.gz)\n";
 	}
 
@@ -172,6 +441,61 @@ int main(int argc,char** argv)
    			{
    			app.first_line_is_header =false;
    			}
+   		else if(std::strcmp(argv[optind],"--threads")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			app.nthreads=(int)strtol(argv[++optind],&p2,10);
+   			if(app.nthreads<1 || *p2!=0)
+   			    {
+   			    cerr << "Bad number of threads\n";
+   			    usage(argv[0]);
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--rows")==0 && optind+1<argc)
+   			{
+   			char* p=argv[++optind];
+   			char* p2;
+   			app.rows=true;
+   			app.row_start=strtoull(p,&p2,10);
+   			app.row_end=app.row_start;
+   			if(*p2=='-')
+   			    {
+   			    p=p2+1;
+   			    p2=p;
+   			    app.row_end=(*p==0?(uint64_t)-1:strtoull(p,&p2,10));
+   			    }
+   			if(*p2!=0 || app.row_start<1 || app.row_end< app.row_start)
+   			    {
+   			    cerr << "Bad rows " << argv[optind] << "\n";
+   			    usage(argv[0]);
+   			    return EXIT_FAILURE;
+   			    }
+   			}
+   		else if(std::strcmp(argv[optind],"--transpose")==0)
+   			{
+   			app.transposing=true;
+   			}
+   		else if(std::strcmp(argv[optind],"--memory")==0 && optind+1<argc)
+   			{
+   			char* p2;
+   			long mb=strtol(argv[++optind],&p2,10);
+   			if(mb<1 || *p2!=0)
+   			    {
+   			    cerr << "Bad memory\n";
+   			    usage(argv[0]);
+   			    return EXIT_FAILURE;
+   			    }
+   			app.memory=(size_t)mb*1048576;
+   			}
+   		else if(std::strcmp(argv[optind],"--tmpdir")==0 && optind+1<argc)
+   			{
+   			app.tmpdir.assign(argv[++optind]);
+   			}
+   		else if(std::strcmp(argv[optind],"--key")==0 && optind+1<argc)
+   			{
+   			app.keys.push_back(argv[++optind]);
+   			}
    		else if((std::strcmp(argv[optind],"-d")==0 ||
    			 std::strcmp(argv[optind],"--delim")==0)
    			&& optind+1< argc)
@@ -197,31 +521,56 @@ int main(int argc,char** argv)
    			}
    		++optind;
                 }
-
-    if(optind==argc)
+    LineIndex index;
+    if(app.rows || !app.keys.empty())
+	{
+	if(optind+1!=argc)
 	    {
-	    gzFile in=gzdopen(fileno(stdin),"r");
-	    if(in==NULL)
-		{
-		cerr << "Cannot open stdin" << endl;
-		return EXIT_FAILURE;
-		}
-	    app.run(in);
+	    cerr << "--rows and --key need a file\n";
+	    return EXIT_FAILURE;
+	    }
+	try
+	    {
+	    index.open(argv[optind],app.delim,app.nthreads);
 	    }
-    else
+	catch(std::exception& err)
 	    {
-	    while(optind< argc)
+	    cerr << "Cannot index " << argv[optind] << ": " << err.what() << endl;
+	    return EXIT_FAILURE;
+	    }
+	app.index=&index;
+	}
+
+    try
+	{
+	if(optind==argc)
+		{
+		BgzfReader in(stdin,app.nthreads);
+		app.run(in);
+		}
+	else
 		{
-		char* filename=argv[optind++];
-		gzFile in=gzopen(filename,"r");
-		if(in==NULL)
+		while(optind< argc)
 		    {
-		    cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
-		    return EXIT_FAILURE;
+		    char* filename=argv[optind++];
+		    FILE* in=fopen(filename,"rb");
+		    if(in==NULL)
+			{
+			cerr << "Cannot open "<< filename << " " << strerror(errno) << endl;
+			return EXIT_FAILURE;
+			}
+			{
+			BgzfReader reader(in,app.nthreads);
+			app.run(reader);
+			}
+		    fclose(in);
 		    }
-		app.run(in);
-		gzclose(in);
 		}
-	    }
+	}
+    catch(std::exception& err)
+	{
+	cerr << err.what() << endl;
+	return EXIT_FAILURE;
+	}
     return EXIT_SUCCESS;
     }